@@ -1,33 +1,815 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <fstream>
 #include <mpi.h>
 
-int main(int argc, char **argv)
+// MPI datatype matching each vertex/edge id type, picked at compile time
+template <typename T>
+MPI_Datatype mpi_type();
+
+template <>
+MPI_Datatype mpi_type<int32_t>()
 {
-    // Initialize the MPI environment
-    MPI_Init(&argc, &argv);
+    return MPI_INT32_T;
+}
 
-    // Get the number of processes
-    int world_size;
-    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+template <>
+MPI_Datatype mpi_type<int64_t>()
+{
+    return MPI_INT64_T;
+}
 
-    // Get the rank of the process
-    int world_rank;
-    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+// MPI counts are plain ints, so buffers longer than INT_MAX elements are moved in pieces
+const int64_t max_chunk = std::numeric_limits<int>::max();
+
+template <typename T>
+void bcast_chunked(T *buf, int64_t n, MPI_Comm comm)
+{
+    for (int64_t i = 0; i < n; i += max_chunk)
+    {
+        MPI_Bcast(buf + i, std::min(max_chunk, n - i), mpi_type<T>(), 0, comm);
+    }
+}
+
+template <typename T>
+void allreduce_chunked(T *buf, int64_t n, MPI_Op op, MPI_Comm comm)
+{
+    for (int64_t i = 0; i < n; i += max_chunk)
+    {
+        MPI_Allreduce(MPI_IN_PLACE, buf + i, std::min(max_chunk, n - i), mpi_type<T>(), op, comm);
+    }
+}
+
+template <typename T>
+void send_chunked(const T *buf, int64_t n, int dest, MPI_Comm comm)
+{
+    for (int64_t i = 0; i < n; i += max_chunk)
+    {
+        MPI_Send(buf + i, std::min(max_chunk, n - i), mpi_type<T>(), dest, 0, comm);
+    }
+}
+
+template <typename T>
+void recv_chunked(T *buf, int64_t n, int source, MPI_Comm comm)
+{
+    for (int64_t i = 0; i < n; i += max_chunk)
+    {
+        MPI_Recv(buf + i, std::min(max_chunk, n - i), mpi_type<T>(), source, 0, comm, MPI_STATUS_IGNORE);
+    }
+}
+
+// Collectives with per-rank counts go in rounds: in each round every rank contributes at most
+// max_chunk / world_size elements, so the int counts and displacements of a round always fit.
+// A transfer that fits in one round lands straight in the result.
+int64_t chunk_rounds(int64_t largest, int world_size, int64_t &piece, MPI_Comm comm)
+{
+    piece = std::max<int64_t>(1, max_chunk / world_size);
+    MPI_Allreduce(MPI_IN_PLACE, &largest, 1, MPI_INT64_T, MPI_MAX, comm);
+    return (largest + piece - 1) / piece;
+}
+
+// Concatenates every rank's mine on the root, in rank order
+template <typename T>
+std::vector<T> gatherv_chunked(const std::vector<T> &mine, int world_size, int world_rank, MPI_Comm comm)
+{
+    int64_t count = mine.size(), piece;
+    std::vector<int64_t> counts(world_size), displs(world_size + 1, 0);
+    MPI_Gather(&count, 1, MPI_INT64_T, counts.data(), 1, MPI_INT64_T, 0, comm);
+    for (int p = 0; p < world_size; p++)
+    {
+        displs[p + 1] = displs[p] + counts[p];
+    }
+
+    std::vector<T> all(world_rank == 0 ? displs[world_size] : 0), buffer;
+    int64_t rounds = chunk_rounds(count, world_size, piece, comm);
+    std::vector<int> round_counts(world_size), round_displs(world_size);
+    for (int64_t k = 0; k < rounds; k++)
+    {
+        int64_t offset = k * piece;
+        int total = 0;
+        for (int p = 0; p < world_size; p++)
+        {
+            round_counts[p] = std::min(piece, std::max<int64_t>(counts[p] - offset, 0));
+            round_displs[p] = total;
+            total += round_counts[p];
+        }
+        T *target = all.data();
+        if (rounds > 1)
+        {
+            buffer.resize(world_rank == 0 ? total : 0);
+            target = buffer.data();
+        }
+        int my_count = std::min(piece, std::max<int64_t>(count - offset, 0));
+        MPI_Gatherv(mine.data() + std::min(offset, count), my_count, mpi_type<T>(), target, round_counts.data(),
+                    round_displs.data(), mpi_type<T>(), 0, comm);
+        if (rounds > 1 && world_rank == 0)
+        {
+            for (int p = 0; p < world_size; p++)
+            {
+                std::copy(buffer.begin() + round_displs[p], buffer.begin() + round_displs[p] + round_counts[p],
+                          all.begin() + displs[p] + offset);
+            }
+        }
+    }
+    return all;
+}
+
+// Concatenates every rank's mine on every rank, in rank order
+template <typename T>
+std::vector<T> allgatherv_chunked(const std::vector<T> &mine, int world_size, MPI_Comm comm)
+{
+    int64_t count = mine.size(), piece;
+    std::vector<int64_t> counts(world_size), displs(world_size + 1, 0);
+    MPI_Allgather(&count, 1, MPI_INT64_T, counts.data(), 1, MPI_INT64_T, comm);
+    for (int p = 0; p < world_size; p++)
+    {
+        displs[p + 1] = displs[p] + counts[p];
+    }
+
+    std::vector<T> all(displs[world_size]), buffer;
+    int64_t rounds = chunk_rounds(count, world_size, piece, comm);
+    std::vector<int> round_counts(world_size), round_displs(world_size);
+    for (int64_t k = 0; k < rounds; k++)
+    {
+        int64_t offset = k * piece;
+        int total = 0;
+        for (int p = 0; p < world_size; p++)
+        {
+            round_counts[p] = std::min(piece, std::max<int64_t>(counts[p] - offset, 0));
+            round_displs[p] = total;
+            total += round_counts[p];
+        }
+        T *target = all.data();
+        if (rounds > 1)
+        {
+            buffer.resize(total);
+            target = buffer.data();
+        }
+        int my_count = std::min(piece, std::max<int64_t>(count - offset, 0));
+        MPI_Allgatherv(mine.data() + std::min(offset, count), my_count, mpi_type<T>(), target, round_counts.data(),
+                       round_displs.data(), mpi_type<T>(), comm);
+        if (rounds > 1)
+        {
+            for (int p = 0; p < world_size; p++)
+            {
+                std::copy(buffer.begin() + round_displs[p], buffer.begin() + round_displs[p] + round_counts[p],
+                          all.begin() + displs[p] + offset);
+            }
+        }
+    }
+    return all;
+}
+
+// Sends outgoing[p] to rank p for every p and returns what arrived, in source rank order
+template <typename T>
+std::vector<T> alltoallv_chunked(const std::vector<std::vector<T>> &outgoing, int world_size, MPI_Comm comm)
+{
+    std::vector<int64_t> send_counts(world_size), recv_counts(world_size), recv_displs(world_size + 1, 0);
+    int64_t largest = 0, piece;
+    for (int p = 0; p < world_size; p++)
+    {
+        send_counts[p] = outgoing[p].size();
+        largest = std::max(largest, send_counts[p]);
+    }
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT64_T, recv_counts.data(), 1, MPI_INT64_T, comm);
+    for (int p = 0; p < world_size; p++)
+    {
+        recv_displs[p + 1] = recv_displs[p] + recv_counts[p];
+    }
+
+    std::vector<T> all(recv_displs[world_size]), send_buf, recv_buf;
+    int64_t rounds = chunk_rounds(largest, world_size, piece, comm);
+    std::vector<int> round_send_counts(world_size), round_send_displs(world_size), round_recv_counts(world_size),
+        round_recv_displs(world_size);
+    for (int64_t k = 0; k < rounds; k++)
+    {
+        int64_t offset = k * piece;
+        send_buf.clear();
+        int total = 0;
+        for (int p = 0; p < world_size; p++)
+        {
+            round_send_counts[p] = std::min(piece, std::max<int64_t>(send_counts[p] - offset, 0));
+            round_send_displs[p] = send_buf.size();
+            send_buf.insert(send_buf.end(), outgoing[p].begin() + offset, outgoing[p].begin() + offset + round_send_counts[p]);
+            round_recv_counts[p] = std::min(piece, std::max<int64_t>(recv_counts[p] - offset, 0));
+            round_recv_displs[p] = total;
+            total += round_recv_counts[p];
+        }
+        T *target = all.data();
+        if (rounds > 1)
+        {
+            recv_buf.resize(total);
+            target = recv_buf.data();
+        }
+        MPI_Alltoallv(send_buf.data(), round_send_counts.data(), round_send_displs.data(), mpi_type<T>(), target,
+                      round_recv_counts.data(), round_recv_displs.data(), mpi_type<T>(), comm);
+        if (rounds > 1)
+        {
+            for (int p = 0; p < world_size; p++)
+            {
+                std::copy(recv_buf.begin() + round_recv_displs[p],
+                          recv_buf.begin() + round_recv_displs[p] + round_recv_counts[p],
+                          all.begin() + recv_displs[p] + offset);
+            }
+        }
+    }
+    return all;
+}
+
+// Vertex ownership: which rank owns each vertex and where it sits in that rank's local arrays
+template <typename vertex_t>
+struct Partition
+{
+    std::vector<int32_t> owner;
+    std::vector<vertex_t> local_index;
+    std::vector<vertex_t> my_vertices;
+    vertex_t max_count;
+};
+
+template <typename vertex_t>
+Partition<vertex_t> make_partition(std::vector<int32_t> owner, int world_size, int world_rank)
+{
+    Partition<vertex_t> part;
+    part.owner.swap(owner);
+    part.local_index.resize(part.owner.size());
+
+    std::vector<vertex_t> counts(world_size, 0);
+    for (size_t i = 0; i < part.owner.size(); i++)
+    {
+        part.local_index[i] = counts[part.owner[i]]++;
+        if (part.owner[i] == world_rank)
+        {
+            part.my_vertices.push_back(i);
+        }
+    }
+    part.max_count = *std::max_element(counts.begin(), counts.end());
+    return part;
+}
+
+// Edge cut (adjacency entries whose endpoints have different owners) and communication volume
+// (distinct remote owners among each vertex's neighbours, summed) of the held adjacency lists
+template <typename vertex_t>
+void partition_quality(const std::vector<int32_t> &owner, std::vector<std::vector<vertex_t>> &my_adj,
+                       const std::vector<vertex_t> &held, int world_size, int64_t &edges, int64_t &cut, int64_t &volume)
+{
+    int64_t stats[3] = {0, 0, 0};
+    std::vector<vertex_t> seen(world_size, -1);
+    for (vertex_t u : held)
+    {
+        for (vertex_t v : my_adj[u])
+        {
+            stats[0]++;
+            if (owner[v] != owner[u])
+            {
+                stats[1]++;
+                if (seen[owner[v]] != u)
+                {
+                    seen[owner[v]] = u;
+                    stats[2]++;
+                }
+            }
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, stats, 3, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+    edges = stats[0];
+    cut = stats[1];
+    volume = stats[2];
+}
+
+// Distributed label propagation: every rank relabels the vertices whose adjacency it holds
+// to the owner most common among their neighbours, and the moves are exchanged with an
+// Allgatherv after each round. Each part is capped at (1 + imbalance) * V / P vertices and
+// every rank may only fill its share of a part's remaining room per round, so the cap holds
+// without any further coordination. The room left over from an even split goes one slot each
+// to ranks that rotate with the part and the round, so a nearly full part still takes moves.
+template <typename vertex_t>
+std::vector<int32_t> label_propagation(std::vector<int32_t> labels, std::vector<std::vector<vertex_t>> &my_adj,
+                                       const std::vector<vertex_t> &held, int world_size, int world_rank,
+                                       int max_rounds, double imbalance, int &rounds)
+{
+    int64_t V = labels.size();
+    int64_t cap = (int64_t)((1.0 + imbalance) * V / world_size) + 1;
+    std::vector<int64_t> sizes(world_size, 0);
+    for (int32_t label : labels)
+    {
+        sizes[label]++;
+    }
+
+    std::vector<int64_t> votes(world_size, 0), quota(world_size);
+    std::vector<int32_t> touched;
+    std::vector<vertex_t> moves, all_moves;
+
+    for (rounds = 0; rounds < max_rounds; rounds++)
+    {
+        for (int p = 0; p < world_size; p++)
+        {
+            int64_t room = std::max<int64_t>(cap - sizes[p], 0);
+            quota[p] = room / world_size + ((world_rank + p + rounds) % world_size < room % world_size);
+        }
+
+        // move each held vertex to the most common label of its neighbours if there is room
+        moves.clear();
+        for (vertex_t u : held)
+        {
+            touched.clear();
+            for (vertex_t v : my_adj[u])
+            {
+                if (votes[labels[v]]++ == 0)
+                {
+                    touched.push_back(labels[v]);
+                }
+            }
+
+            int32_t best = labels[u];
+            for (int32_t p : touched)
+            {
+                if (votes[p] > votes[best] && quota[p] > 0)
+                {
+                    best = p;
+                }
+            }
+            for (int32_t p : touched)
+            {
+                votes[p] = 0;
+            }
+
+            if (best != labels[u])
+            {
+                quota[best]--;
+                labels[u] = best;
+                moves.push_back(u);
+                moves.push_back(best);
+            }
+        }
+
+        // share the moves so every rank sees the same labels and part sizes
+        all_moves = allgatherv_chunked(moves, world_size, MPI_COMM_WORLD);
+        if (all_moves.empty())
+        {
+            // rounds counts the rounds run, including this one that moved nothing
+            rounds++;
+            break;
+        }
+
+        std::fill(sizes.begin(), sizes.end(), 0);
+        for (size_t i = 0; i < all_moves.size(); i += 2)
+        {
+            labels[all_moves[i]] = all_moves[i + 1];
+        }
+        for (int32_t label : labels)
+        {
+            sizes[label]++;
+        }
+    }
+
+    return labels;
+}
+
+// Sends every held adjacency list to the owner it has in the new partition
+template <typename vertex_t>
+void redistribute_adjacency(std::vector<std::vector<vertex_t>> &my_adj, const std::vector<vertex_t> &held,
+                            const std::vector<int32_t> &owner, int world_size, int world_rank)
+{
+    // each list travels as vertex, degree, neighbours
+    std::vector<std::vector<vertex_t>> outgoing(world_size);
+    for (vertex_t u : held)
+    {
+        if (owner[u] == world_rank)
+        {
+            continue;
+        }
+        std::vector<vertex_t> &out = outgoing[owner[u]];
+        out.push_back(u);
+        out.push_back(my_adj[u].size());
+        out.insert(out.end(), my_adj[u].begin(), my_adj[u].end());
+        std::vector<vertex_t>().swap(my_adj[u]);
+    }
+
+    std::vector<vertex_t> recv_buf = alltoallv_chunked(outgoing, world_size, MPI_COMM_WORLD);
+
+    for (size_t i = 0; i < recv_buf.size();)
+    {
+        vertex_t u = recv_buf[i], degree = recv_buf[i + 1];
+        my_adj[u].assign(recv_buf.begin() + i + 2, recv_buf.begin() + i + 2 + degree);
+        i += 2 + degree;
+    }
+}
+
+// Bulk-synchronous BFS: every rank keeps a full copy of visited, dist and the queues,
+// and the copies are merged with Allreduce after every level
+template <typename vertex_t>
+std::vector<vertex_t> bfs_collective(int world_rank, vertex_t V, vertex_t start, const Partition<vertex_t> &part,
+                                     std::vector<std::vector<vertex_t>> &my_adj, std::vector<vertex_t> &exits,
+                                     vertex_t max_depth, std::vector<vertex_t> &reached, int &levels)
+{
+    std::vector<vertex_t> dist(V, std::numeric_limits<vertex_t>::max());
+    std::vector<int32_t> visited(V, 0);
+
+    // Distributed 1D Parallel BFS
+    vertex_t level = 0;
+    std::vector<int32_t> curr_queue(V, 0), next_queue(V, 0);
+    // every rank knows the start, so its copies are right even if no level runs (max_depth 0)
+    dist[start] = 0;
+    visited[start] = 1;
+    if (part.owner[start] == world_rank)
+    {
+        curr_queue[start] = 1;
+    }
+
+    while (level < max_depth)
+    {
+        // process the current queue
+        for (vertex_t i : part.my_vertices)
+        {
+            if (curr_queue[i] == 0)
+            {
+                continue;
+            }
+
+            for (size_t j = 0; j < my_adj[i].size(); j++)
+            {
+                vertex_t v = my_adj[i][j];
+                if (visited[v] == 0)
+                {
+                    dist[v] = level + 1;
+                    next_queue[v] = 1;
+                    visited[v] = 1;
+                }
+            }
+        }
+
+        // sync everyone's visited array, dist array and next queue array
+        allreduce_chunked(visited.data(), V, MPI_LOR, MPI_COMM_WORLD);
+        allreduce_chunked(dist.data(), V, MPI_MIN, MPI_COMM_WORLD);
+        allreduce_chunked(next_queue.data(), V, MPI_LOR, MPI_COMM_WORLD);
+
+        // check if the next queue is empty
+        int64_t sum = 0;
+        for (vertex_t i = 0; i < V; i++)
+        {
+            sum += next_queue[i];
+        }
+        if (sum == 0)
+        {
+            break;
+        }
+
+        // swap the current queue with the next queue
+        curr_queue.swap(next_queue);
+        next_queue.assign(V, 0);
+
+        // increment the level
+        level++;
+    }
+    levels = level + 1;
+
+    // every rank reports the vertices it owns that were reached, as (vertex, dist) pairs
+    for (vertex_t i : part.my_vertices)
+    {
+        if (dist[i] != std::numeric_limits<vertex_t>::max())
+        {
+            reached.push_back(i);
+            reached.push_back(dist[i]);
+        }
+    }
+
+    // every rank has the full dist array, so the root can read the exits directly
+    std::vector<vertex_t> exit_dist(exits.size());
+    for (size_t i = 0; i < exits.size(); i++)
+    {
+        exit_dist[i] = dist[exits[i]];
+    }
+    return exit_dist;
+}
+
+// Node-aware BFS: the ranks of a node share one copy of the global-sized arrays through an
+// MPI_Win_allocate_shared window, and only the node leaders take part in the Allreduce
+template <typename vertex_t>
+std::vector<vertex_t> bfs_shared(int world_rank, vertex_t V, vertex_t start, const Partition<vertex_t> &part,
+                                 std::vector<std::vector<vertex_t>> &my_adj, std::vector<vertex_t> &exits,
+                                 vertex_t max_depth, std::vector<vertex_t> &reached, int &levels)
+{
+    // group the ranks by node and connect the node leaders
+    MPI_Comm node_comm, leader_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, world_rank, MPI_INFO_NULL, &node_comm);
+    int node_rank;
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, world_rank, &leader_comm);
+
+    // the leader allocates dist, visited and both queues, the other ranks map the same memory
+    char *base;
+    MPI_Win win;
+    MPI_Aint size = node_rank == 0 ? (MPI_Aint)V * (sizeof(vertex_t) + 3 * sizeof(int32_t)) : 0;
+    MPI_Win_allocate_shared(size, 1, MPI_INFO_NULL, node_comm, &base, &win);
+    if (node_rank != 0)
+    {
+        int disp_unit;
+        MPI_Win_shared_query(win, 0, &size, &disp_unit, &base);
+    }
+    vertex_t *dist = (vertex_t *)base;
+    int32_t *visited = (int32_t *)(dist + V);
+    int32_t *curr_queue = visited + V, *next_queue = visited + 2 * (MPI_Aint)V;
+
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    if (node_rank == 0)
+    {
+        std::fill(dist, dist + V, std::numeric_limits<vertex_t>::max());
+        std::fill(visited, visited + 3 * (MPI_Aint)V, 0);
+    }
+    MPI_Win_sync(win);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(win);
+
+    vertex_t level = 0;
+    // the leader marks the start, so each node's copy is right even if no level runs (max_depth 0)
+    if (node_rank == 0)
+    {
+        dist[start] = 0;
+        visited[start] = 1;
+    }
+    if (part.owner[start] == world_rank)
+    {
+        curr_queue[start] = 1;
+    }
+    MPI_Win_sync(win);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(win);
+
+    while (level < max_depth)
+    {
+        // process the current queue, every rank of the node writes into the same arrays
+        for (vertex_t i : part.my_vertices)
+        {
+            if (curr_queue[i] == 0)
+            {
+                continue;
+            }
+
+            for (size_t j = 0; j < my_adj[i].size(); j++)
+            {
+                vertex_t v = my_adj[i][j];
+                if (visited[v] == 0)
+                {
+                    dist[v] = level + 1;
+                    next_queue[v] = 1;
+                    visited[v] = 1;
+                }
+            }
+        }
+        MPI_Win_sync(win);
+        MPI_Barrier(node_comm);
+        MPI_Win_sync(win);
+
+        // only the node leaders sync the node copies with each other
+        if (node_rank == 0)
+        {
+            allreduce_chunked(visited, V, MPI_LOR, leader_comm);
+            allreduce_chunked(dist, V, MPI_MIN, leader_comm);
+            allreduce_chunked(next_queue, V, MPI_LOR, leader_comm);
+        }
+        MPI_Win_sync(win);
+        MPI_Barrier(node_comm);
+        MPI_Win_sync(win);
+
+        // check if the next queue is empty
+        int64_t sum = 0;
+        for (vertex_t i = 0; i < V; i++)
+        {
+            sum += next_queue[i];
+        }
+        if (sum == 0)
+        {
+            break;
+        }
 
-    int V, E, K, start, B;
-    std::vector<std::vector<int>> adj;
-    std::vector<int> exits, blocked;
+        // swap the current queue with the next queue, the leader clears the new next queue
+        std::swap(curr_queue, next_queue);
+        if (node_rank == 0)
+        {
+            std::fill(next_queue, next_queue + V, 0);
+        }
+        MPI_Win_sync(win);
+        MPI_Barrier(node_comm);
+        MPI_Win_sync(win);
 
+        // increment the level
+        level++;
+    }
+    levels = level + 1;
+
+    for (vertex_t i : part.my_vertices)
+    {
+        if (dist[i] != std::numeric_limits<vertex_t>::max())
+        {
+            reached.push_back(i);
+            reached.push_back(dist[i]);
+        }
+    }
+
+    std::vector<vertex_t> exit_dist(exits.size());
+    for (size_t i = 0; i < exits.size(); i++)
+    {
+        exit_dist[i] = dist[exits[i]];
+    }
+
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+    if (leader_comm != MPI_COMM_NULL)
+    {
+        MPI_Comm_free(&leader_comm);
+    }
+    MPI_Comm_free(&node_comm);
+
+    return exit_dist;
+}
+
+// One-sided BFS: each rank only keeps the dist slice of the vertices it owns, and discoveries
+// of remote vertices are pushed with MPI_Put into per-source inbox slots of the owner's window.
+// The whole search runs inside a single passive-target epoch, and the only synchronisation per
+// level is one single-integer Allreduce that also tells everyone whether anything was sent.
+template <typename vertex_t>
+std::vector<vertex_t> bfs_rma(int world_size, int world_rank, vertex_t V, vertex_t start, const Partition<vertex_t> &part,
+                              std::vector<std::vector<vertex_t>> &my_adj, std::vector<vertex_t> &exits,
+                              vertex_t max_depth, std::vector<vertex_t> &reached, int &levels)
+{
+    // vertex i is owned by rank part.owner[i] and lives at local index part.local_index[i]
+    vertex_t my_count = part.my_vertices.size();
+    vertex_t cap = part.max_count;
+
+    vertex_t *local_dist;
+    MPI_Win dist_win;
+    MPI_Win_allocate(std::max<vertex_t>(my_count, 1) * sizeof(vertex_t), sizeof(vertex_t), MPI_INFO_NULL, MPI_COMM_WORLD, &local_dist, &dist_win);
+    std::fill(local_dist, local_dist + my_count, std::numeric_limits<vertex_t>::max());
+
+    // the inbox is double buffered by level parity, each half holds one count per source
+    // followed by one slot of cap vertices per source
+    MPI_Aint half_size = world_size + (MPI_Aint)world_size * cap;
+    vertex_t *inbox;
+    MPI_Win inbox_win;
+    MPI_Win_allocate(2 * half_size * sizeof(vertex_t), sizeof(vertex_t), MPI_INFO_NULL, MPI_COMM_WORLD, &inbox, &inbox_win);
+    std::fill(inbox, inbox + 2 * half_size, 0);
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, inbox_win);
+
+    // a vertex is pushed to its owner at most once, so one slot of cap entries per source is enough
+    std::vector<char> sent(V, 0);
+    std::vector<std::vector<vertex_t>> outbox(world_size);
+    std::vector<vertex_t> out_count(world_size);
+    std::vector<vertex_t> frontier, next_frontier;
+
+    if (part.owner[start] == world_rank)
+    {
+        local_dist[part.local_index[start]] = 0;
+        frontier.push_back(start);
+    }
+
+    vertex_t level = 0;
+    while (level < max_depth)
+    {
+        MPI_Aint half = (level % 2) * half_size;
+
+        // collect the neighbours of the frontier per owner
+        for (int t = 0; t < world_size; t++)
+        {
+            outbox[t].clear();
+        }
+        for (vertex_t u : frontier)
+        {
+            for (vertex_t v : my_adj[u])
+            {
+                if (!sent[v])
+                {
+                    sent[v] = 1;
+                    outbox[part.owner[v]].push_back(v);
+                }
+            }
+        }
+
+        // push the remote discoveries into the owners' inboxes
+        int64_t total_sent = 0;
+        for (int t = 0; t < world_size; t++)
+        {
+            total_sent += outbox[t].size();
+            if (t == world_rank || outbox[t].empty())
+            {
+                continue;
+            }
+            out_count[t] = outbox[t].size();
+            MPI_Aint slot = half + world_size + (MPI_Aint)world_rank * cap;
+            for (int64_t i = 0; i < out_count[t]; i += max_chunk)
+            {
+                int n = std::min<int64_t>(max_chunk, out_count[t] - i);
+                MPI_Put(outbox[t].data() + i, n, mpi_type<vertex_t>(), t, slot + i, n, mpi_type<vertex_t>(), inbox_win);
+            }
+            MPI_Put(&out_count[t], 1, mpi_type<vertex_t>(), t, half + world_rank, 1, mpi_type<vertex_t>(), inbox_win);
+        }
+        MPI_Win_flush_all(inbox_win);
+
+        // the single synchronisation point of the level
+        MPI_Allreduce(MPI_IN_PLACE, &total_sent, 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+        if (total_sent == 0)
+        {
+            break;
+        }
+        MPI_Win_sync(inbox_win);
+
+        // keep the candidates that have not been reached yet as the next frontier
+        next_frontier.clear();
+        for (int s = 0; s < world_size; s++)
+        {
+            vertex_t *candidates = inbox + half + world_size + (MPI_Aint)s * cap;
+            vertex_t count = inbox[half + s];
+            if (s == world_rank)
+            {
+                candidates = outbox[s].data();
+                count = outbox[s].size();
+            }
+
+            for (vertex_t j = 0; j < count; j++)
+            {
+                vertex_t v = candidates[j];
+                if (local_dist[part.local_index[v]] == std::numeric_limits<vertex_t>::max())
+                {
+                    local_dist[part.local_index[v]] = level + 1;
+                    next_frontier.push_back(v);
+                }
+            }
+            inbox[half + s] = 0;
+        }
+        MPI_Win_sync(inbox_win);
+
+        frontier.swap(next_frontier);
+        level++;
+    }
+    levels = level + 1;
+
+    MPI_Win_unlock_all(inbox_win);
+    MPI_Win_free(&inbox_win);
+
+    for (vertex_t j = 0; j < my_count; j++)
+    {
+        if (local_dist[j] != std::numeric_limits<vertex_t>::max())
+        {
+            reached.push_back(part.my_vertices[j]);
+            reached.push_back(local_dist[j]);
+        }
+    }
+
+    // the root reads the exit distances straight out of the owners' dist slices
+    std::vector<vertex_t> exit_dist(exits.size());
+    MPI_Barrier(MPI_COMM_WORLD);
     if (world_rank == 0)
     {
-        // Root process reads the input
-        std::cin >> V >> E;
+        MPI_Win_lock_all(0, dist_win);
+        for (size_t i = 0; i < exits.size(); i++)
+        {
+            MPI_Get(&exit_dist[i], 1, mpi_type<vertex_t>(), part.owner[exits[i]], part.local_index[exits[i]], 1, mpi_type<vertex_t>(), dist_win);
+        }
+        MPI_Win_unlock_all(dist_win);
+    }
+    MPI_Win_free(&dist_win);
+
+    return exit_dist;
+}
 
+// Command line options of a run
+struct Options
+{
+    std::string transport = "collective";
+    int64_t max_depth = -1;
+    bool report_time = false;
+    std::string partition = "round-robin";
+    std::string partition_in, partition_out;
+};
+
+// Reads the rest of the input after the V E header and runs the search with vertex ids of
+// type vertex_t and edge counts of type edge_t. A negative max_depth searches to exhaustion,
+// otherwise the search stops after max_depth levels and the root also lists every vertex
+// reached within that many hops.
+template <typename vertex_t, typename edge_t>
+void run_bfs(int world_size, int world_rank, vertex_t V, edge_t E, const Options &opts)
+{
+    const std::string &transport = opts.transport;
+    int64_t max_depth = opts.max_depth;
+
+    vertex_t K, start, B;
+    std::vector<std::vector<vertex_t>> adj;
+    std::vector<vertex_t> exits, blocked;
+
+    if (world_rank == 0)
+    {
+        // Root process reads the input
         adj.resize(V);
-        for (int i = 0; i < E; i++)
+        for (edge_t i = 0; i < E; i++)
         {
-            int u, v, d;
+            vertex_t u, v;
+            int d;
             std::cin >> u >> v >> d;
             adj[v].push_back(u);
             if (d == 1)
@@ -38,7 +820,7 @@ int main(int argc, char **argv)
 
         std::cin >> K;
         exits.resize(K);
-        for (int i = 0; i < K; i++)
+        for (vertex_t i = 0; i < K; i++)
         {
             std::cin >> exits[i];
         }
@@ -47,33 +829,67 @@ int main(int argc, char **argv)
 
         std::cin >> B;
         blocked.resize(B);
-        for (int i = 0; i < B; i++)
+        for (vertex_t i = 0; i < B; i++)
         {
             std::cin >> blocked[i];
         }
     }
 
-    // Broadcast the values of V, E, K, exit, and B
-    MPI_Bcast(&V, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&E, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&K, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&start, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&B, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    // Broadcast the values of K, exit, and B
+    MPI_Bcast(&K, 1, mpi_type<vertex_t>(), 0, MPI_COMM_WORLD);
+    MPI_Bcast(&start, 1, mpi_type<vertex_t>(), 0, MPI_COMM_WORLD);
+    MPI_Bcast(&B, 1, mpi_type<vertex_t>(), 0, MPI_COMM_WORLD);
 
     // iterate through the adjacency list and remove all incoming and outgoing edges to blocked vertices
     if (world_rank == 0)
     {
-        for (int i = 0; i < B; i++)
+        for (vertex_t i = 0; i < B; i++)
         {
-            for (int j = 0; j < V; j++)
+            for (vertex_t j = 0; j < V; j++)
             {
                 adj[j].erase(std::remove(adj[j].begin(), adj[j].end(), blocked[i]), adj[j].end());
             }
         }
     }
 
-    std::vector<int> my_vertices;
-    std::vector<std::vector<int>> my_adj(V);
+    // round-robin ownership, unless a saved assignment is reused
+    std::vector<int32_t> owner(V);
+    if (!opts.partition_in.empty())
+    {
+        if (world_rank == 0)
+        {
+            std::ifstream file(opts.partition_in);
+            int64_t file_V = -1;
+            int file_P = -1;
+            file >> file_V >> file_P;
+            if (file_V != V || file_P != world_size)
+            {
+                std::cerr << "partition file " << opts.partition_in << " is for " << file_V << " vertices on "
+                          << file_P << " processes" << std::endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            for (vertex_t i = 0; i < V; i++)
+            {
+                file >> owner[i];
+                if (!file || owner[i] < 0 || owner[i] >= world_size)
+                {
+                    std::cerr << "partition file " << opts.partition_in << " has no owner in [0, " << world_size
+                              << ") for vertex " << i << std::endl;
+                    MPI_Abort(MPI_COMM_WORLD, 1);
+                }
+            }
+        }
+        bcast_chunked(owner.data(), V, MPI_COMM_WORLD);
+    }
+    else
+    {
+        for (vertex_t i = 0; i < V; i++)
+        {
+            owner[i] = i % world_size;
+        }
+    }
+
+    std::vector<std::vector<vertex_t>> my_adj(V);
 
     if (world_rank != 0)
     {
@@ -85,50 +901,99 @@ int main(int argc, char **argv)
     // Broadcast appropriate vertices' adjacency list to each process
     if (world_rank == 0)
     {
-        for (int i = 0; i < V; i++)
+        for (vertex_t i = 0; i < V; i++)
         {
-            int owner = i % world_size;
-            if (owner == 0)
+            if (owner[i] == 0)
             {
                 my_adj[i] = adj[i];
             }
             else
             {
-                int size = adj[i].size();
-                MPI_Send(&size, 1, MPI_INT, owner, 0, MPI_COMM_WORLD);
-                MPI_Send(adj[i].data(), size, MPI_INT, owner, 0, MPI_COMM_WORLD);
+                edge_t size = adj[i].size();
+                MPI_Send(&size, 1, mpi_type<edge_t>(), owner[i], 0, MPI_COMM_WORLD);
+                send_chunked(adj[i].data(), size, owner[i], MPI_COMM_WORLD);
             }
         }
     }
     else
     {
-        for (int i = 0; i < V; i++)
+        for (vertex_t i = 0; i < V; i++)
         {
-            if (i % world_size == world_rank)
+            if (owner[i] == world_rank)
             {
-                int size;
-                MPI_Recv(&size, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                edge_t size;
+                MPI_Recv(&size, 1, mpi_type<edge_t>(), 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
                 my_adj[i].resize(size);
-                MPI_Recv(my_adj[i].data(), size, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                recv_chunked(my_adj[i].data(), size, 0, MPI_COMM_WORLD);
             }
         }
     }
 
     // Broadcast the starting vertices and blocked vertices
-    MPI_Bcast(exits.data(), K, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(blocked.data(), B, MPI_INT, 0, MPI_COMM_WORLD);
+    bcast_chunked(exits.data(), K, MPI_COMM_WORLD);
+    bcast_chunked(blocked.data(), B, MPI_COMM_WORLD);
+
+    // optionally move the vertices to the owners that minimise the edge cut
+    int64_t edges, cut, volume;
+    Partition<vertex_t> part = make_partition<vertex_t>(owner, world_size, world_rank);
+    if (opts.partition == "lp")
+    {
+        partition_quality(part.owner, my_adj, part.my_vertices, world_size, edges, cut, volume);
+        if (world_rank == 0)
+        {
+            std::cerr << "partition: round-robin edge cut " << cut << " of " << edges << ", communication volume " << volume << std::endl;
+        }
 
-    // vertices belonging to each process
-    for (int i = 0; i < V; i++)
+        // seed the labels with contiguous id blocks, which already follow any locality in the
+        // numbering, and let the propagation move the vertices along the block boundaries
+        for (vertex_t i = 0; i < V; i++)
+        {
+            owner[i] = (int64_t)i * world_size / V;
+        }
+
+        int rounds;
+        owner = label_propagation(owner, my_adj, part.my_vertices, world_size, world_rank, 20, 0.05, rounds);
+
+        // the cut only depends on the labels, so it can be judged before anything moves; a graph
+        // without locality in its numbering can come out worse than round-robin, which is kept then
+        int64_t round_robin_cut = cut;
+        partition_quality(owner, my_adj, part.my_vertices, world_size, edges, cut, volume);
+        if (cut < round_robin_cut)
+        {
+            redistribute_adjacency(my_adj, part.my_vertices, owner, world_size, world_rank);
+            part = make_partition<vertex_t>(owner, world_size, world_rank);
+        }
+        if (world_rank == 0)
+        {
+            std::cerr << "partition: label propagation (" << rounds << " rounds) edge cut " << cut << " of " << edges
+                      << ", communication volume " << volume << ", largest part " << part.max_count;
+            if (cut >= round_robin_cut)
+            {
+                std::cerr << ", keeping round-robin";
+            }
+            std::cerr << std::endl;
+        }
+    }
+    else if (!opts.partition_in.empty())
     {
-        if (i % world_size == world_rank)
+        partition_quality(part.owner, my_adj, part.my_vertices, world_size, edges, cut, volume);
+        if (world_rank == 0)
         {
-            my_vertices.push_back(i);
+            std::cerr << "partition: " << opts.partition_in << " edge cut " << cut << " of " << edges
+                      << ", communication volume " << volume << ", largest part " << part.max_count << std::endl;
         }
     }
 
-    std::vector<int> dist(V, std::numeric_limits<int>::max());
-    std::vector<int> visited(V, 0);
+    // save the assignment so later runs can reuse it with --partition-in
+    if (!opts.partition_out.empty() && world_rank == 0)
+    {
+        std::ofstream file(opts.partition_out);
+        file << V << " " << world_size << "\n";
+        for (vertex_t i = 0; i < V; i++)
+        {
+            file << part.owner[i] << "\n";
+        }
+    }
 
     // if the start is in blocked vertices, then exit the program with distance -1
     if (std::find(blocked.begin(), blocked.end(), start) != blocked.end())
@@ -136,89 +1001,166 @@ int main(int argc, char **argv)
         if (world_rank == 0)
         {
             // set all values to -1
-            dist.assign(V, -1);
-            for (int i = 0; i < K; i++)
+            for (vertex_t i = 0; i < K; i++)
             {
-                std::cout << dist[exits[i]] << " ";
+                std::cout << -1 << " ";
             }
             std::cout << std::endl;
+
+            // nothing is reachable from a blocked start
+            if (max_depth >= 0)
+            {
+                std::cout << 0 << std::endl;
+            }
         }
-        MPI_Finalize();
-        return 0;
+        return;
     }
 
-    // Distributed 1D Parallel BFS
-    int level = 0;
-    std::vector<int> curr_queue(V, 0), next_queue(V, 0);
-    if (start % world_size == world_rank)
+    vertex_t depth = max_depth < 0 ? std::numeric_limits<vertex_t>::max() : std::min<int64_t>(max_depth, V);
+    std::vector<vertex_t> reached;
+    int levels = 0;
+    MPI_Barrier(MPI_COMM_WORLD);
+    double bfs_start = MPI_Wtime();
+
+    std::vector<vertex_t> exit_dist;
+    if (transport == "rma")
     {
-        dist[start] = 0;
-        curr_queue[start] = 1;
-        visited[start] = 1;
+        exit_dist = bfs_rma(world_size, world_rank, V, start, part, my_adj, exits, depth, reached, levels);
+    }
+    else if (transport == "shm")
+    {
+        exit_dist = bfs_shared(world_rank, V, start, part, my_adj, exits, depth, reached, levels);
+    }
+    else
+    {
+        exit_dist = bfs_collective(world_rank, V, start, part, my_adj, exits, depth, reached, levels);
     }
 
-    while (true)
+    // gather the (vertex, dist) pairs of a depth-bounded query to the root
+    std::vector<vertex_t> all_reached;
+    if (max_depth >= 0)
     {
-        // process the current queue
-        for (int i = 0; i < V; i++)
+        all_reached = gatherv_chunked(reached, world_size, world_rank, MPI_COMM_WORLD);
+    }
+
+    double bfs_time = MPI_Wtime() - bfs_start;
+    MPI_Allreduce(MPI_IN_PLACE, &bfs_time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+    // print the distance array for the exit vertices
+    if (world_rank == 0)
+    {
+        for (vertex_t i = 0; i < K; i++)
         {
-            if (curr_queue[i] == 0 || i % world_size != world_rank)
+            if (exit_dist[i] == std::numeric_limits<vertex_t>::max())
             {
-                continue;
+                exit_dist[i] = -1;
             }
+            std::cout << exit_dist[i] << " ";
+        }
+        std::cout << std::endl;
 
-            for (int j = 0; j < my_adj[i].size(); j++)
+        // list the reached vertices by distance, then by id
+        if (max_depth >= 0)
+        {
+            std::vector<std::pair<vertex_t, vertex_t>> pairs(all_reached.size() / 2);
+            for (size_t i = 0; i < pairs.size(); i++)
             {
-                int v = my_adj[i][j];
-                if (visited[v] == 0)
-                {
-                    dist[v] = level + 1;
-                    next_queue[v] = 1;
-                    visited[v] = 1;
-                }
+                pairs[i] = {all_reached[2 * i + 1], all_reached[2 * i]};
+            }
+            std::sort(pairs.begin(), pairs.end());
+
+            std::cout << pairs.size() << std::endl;
+            for (const auto &p : pairs)
+            {
+                std::cout << p.second << " " << p.first << std::endl;
             }
         }
 
-        // sync everyone's visited array, dist array and next queue array
-        MPI_Allreduce(MPI_IN_PLACE, visited.data(), V, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
-        MPI_Allreduce(MPI_IN_PLACE, dist.data(), V, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
-        MPI_Allreduce(MPI_IN_PLACE, next_queue.data(), V, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+        if (opts.report_time)
+        {
+            std::cerr << "bfs: " << transport << " transport, " << 8 * sizeof(vertex_t) << "-bit vertex ids, "
+                      << 8 * sizeof(edge_t) << "-bit edge counts, " << levels << " levels, "
+                      << bfs_time << " s on " << world_size << " processes" << std::endl;
+        }
+    }
+}
 
-        // check if the next queue is empty
-        int sum = 0;
-        for (int i = 0; i < V; i++)
+int main(int argc, char **argv)
+{
+    // Initialize the MPI environment
+    MPI_Init(&argc, &argv);
+
+    // Get the number of processes
+    int world_size;
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    // Get the rank of the process
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+
+    // --rma switches to the one-sided transport, --shm to the node-shared arrays,
+    // --max-depth k bounds the search to k hops, --time reports the BFS time on stderr,
+    // --partition lp computes edge-cut-minimising ownership, --partition-out/--partition-in
+    // save and reuse an ownership assignment
+    Options opts;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rma") == 0)
         {
-            sum += next_queue[i];
+            opts.transport = "rma";
         }
-        if (sum == 0)
+        else if (strcmp(argv[i], "--shm") == 0)
         {
-            break;
+            opts.transport = "shm";
+        }
+        else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc)
+        {
+            opts.max_depth = std::stoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time") == 0)
+        {
+            opts.report_time = true;
+        }
+        else if (strcmp(argv[i], "--partition") == 0 && i + 1 < argc)
+        {
+            opts.partition = argv[++i];
+        }
+        else if (strcmp(argv[i], "--partition-in") == 0 && i + 1 < argc)
+        {
+            opts.partition_in = argv[++i];
+        }
+        else if (strcmp(argv[i], "--partition-out") == 0 && i + 1 < argc)
+        {
+            opts.partition_out = argv[++i];
         }
+    }
 
-        // swap the current queue with the next queue
-        curr_queue.swap(next_queue);
-        next_queue.assign(V, 0);
+    // the V E header decides how wide the vertex ids and edge counts have to be
+    int64_t V, E;
+    if (world_rank == 0)
+    {
+        std::cin >> V >> E;
+    }
+    MPI_Bcast(&V, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&E, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
 
-        // increment the level
-        level++;
+    // keep the 32-bit instantiation whenever the graph fits, it halves the memory of every array
+    const int64_t int32_limit = std::numeric_limits<int32_t>::max();
+    if (V <= int32_limit && E <= int32_limit)
+    {
+        run_bfs<int32_t, int32_t>(world_size, world_rank, V, E, opts);
+    }
+    else if (V <= int32_limit)
+    {
+        run_bfs<int32_t, int64_t>(world_size, world_rank, V, E, opts);
+    }
+    else
+    {
+        run_bfs<int64_t, int64_t>(world_size, world_rank, V, E, opts);
     }
 
     // Finalize the MPI environment
     MPI_Finalize();
 
-    // print the distance array for the exit vertices
-    if (world_rank == 0)
-    {
-        for (int i = 0; i < K; i++)
-        {
-            if (dist[exits[i]] == std::numeric_limits<int>::max())
-            {
-                dist[exits[i]] = -1;
-            }
-            std::cout << dist[exits[i]] << " ";
-        }
-        std::cout << std::endl;
-    }
-
     return 0;
 }
@@ -2,6 +2,23 @@
 #include <vector>
 #include <mpi.h>
 #include <cstring>
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <queue>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <string>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 struct Ball
 {
@@ -11,6 +28,2049 @@ struct Ball
     int d;  // Direction
 };
 
+// Local balls as a structure of arrays, so the per-step loops stream over plain int arrays.
+// Resizing never releases capacity, so once the arrays have grown to the largest local
+// population no step reallocates them.
+struct BallSet
+{
+    std::vector<int> id, x, y, d;
+
+    BallSet() {}
+
+    BallSet(const std::vector<Ball> &balls)
+    {
+        append(balls);
+    }
+
+    size_t size() const
+    {
+        return id.size();
+    }
+
+    void resize(size_t n)
+    {
+        id.resize(n);
+        x.resize(n);
+        y.resize(n);
+        d.resize(n);
+    }
+
+    // bulk-append balls received as records
+    void append(const Ball *balls, size_t count)
+    {
+        size_t n = size();
+        resize(n + count);
+        for (size_t i = 0; i < count; i++)
+        {
+            id[n + i] = balls[i].id;
+            x[n + i] = balls[i].x;
+            y[n + i] = balls[i].y;
+            d[n + i] = balls[i].d;
+        }
+    }
+
+    void append(const std::vector<Ball> &balls)
+    {
+        append(balls.data(), balls.size());
+    }
+
+    void swap(BallSet &other)
+    {
+        id.swap(other.id);
+        x.swap(other.x);
+        y.swap(other.y);
+        d.swap(other.d);
+    }
+
+    std::vector<Ball> to_balls() const
+    {
+        std::vector<Ball> balls(size());
+        for (size_t i = 0; i < size(); i++)
+        {
+            balls[i] = {id[i], x[i], y[i], d[i]};
+        }
+        return balls;
+    }
+};
+
+// Wire format of the balls migrating in the per-step loop, sent as MPI_UINT64_T: one word per
+// ball holding id | x | y | d from the high bits down, each field just wide enough for K, N and
+// M, which halves the 16-byte records. Grids and ball counts too large for 64 bits fall back to
+// two words, x | y | d and then the id.
+struct BallPacking
+{
+    int x_shift, id_shift, words;
+
+    BallPacking(int N, int M, int64_t K)
+    {
+        x_shift = 2 + bits(M);
+        id_shift = x_shift + bits(N);
+        words = id_shift + bits(K) <= 64 ? 1 : 2;
+    }
+
+    // bits needed for the values 0 .. n - 1
+    static int bits(int64_t n)
+    {
+        int b = 0;
+        while (b < 63 && (int64_t(1) << b) < n)
+        {
+            b++;
+        }
+        return b;
+    }
+
+    void pack(const BallSet &balls, size_t i, std::vector<uint64_t> &out) const
+    {
+        uint64_t word = (uint64_t)balls.x[i] << x_shift | (uint64_t)balls.y[i] << 2 | balls.d[i];
+        if (words == 1)
+        {
+            out.push_back(word | (uint64_t)balls.id[i] << id_shift);
+        }
+        else
+        {
+            out.push_back(word);
+            out.push_back(balls.id[i]);
+        }
+    }
+
+    // appends the count balls packed at in
+    void unpack(const uint64_t *in, size_t count, BallSet &balls) const
+    {
+        size_t n = balls.size();
+        balls.resize(n + count);
+        uint64_t y_mask = (uint64_t(1) << (x_shift - 2)) - 1, x_mask = (uint64_t(1) << (id_shift - x_shift)) - 1;
+        for (size_t i = 0; i < count; i++, in += words)
+        {
+            uint64_t word = in[0];
+            balls.id[n + i] = words == 1 ? word >> id_shift : in[1];
+            balls.x[n + i] = word >> x_shift & x_mask;
+            balls.y[n + i] = word >> 2 & y_mask;
+            balls.d[n + i] = word & 3;
+        }
+    }
+};
+
+// Contiguous row slabs in rank order: rank r owns rows [begin[r], begin[r + 1]). Starts as the
+// equal split x * world_size / N and can be moved to follow the balls; every rank keeps at
+// least one row, so a ball leaving a slab always lands in the neighbouring rank's.
+struct RowSplit
+{
+    std::vector<int> begin;
+
+    RowSplit(int N, int world_size) : begin(world_size + 1)
+    {
+        for (int r = 0; r <= world_size; r++)
+        {
+            begin[r] = ((int64_t)r * N + world_size - 1) / world_size;
+        }
+    }
+
+    int owner(int x) const
+    {
+        return std::upper_bound(begin.begin(), begin.end(), x) - begin.begin() - 1;
+    }
+};
+
+// Px x Py process grid over the N x M cells on a periodic cartesian communicator. The rank at
+// coordinates (cx, cy) owns rows [rows.begin[cx], rows.begin[cx + 1]) of the columns
+// [cols.begin[cy], cols.begin[cy + 1]); with Py = 1 these are the plain row slabs. Ranks are
+// not reordered, so the cartesian rank cx * Py + cy is also the rank in the parent communicator.
+struct Blocks
+{
+    MPI_Comm comm;
+    int px, py, cx, cy;
+    RowSplit rows, cols;
+    int neighbour[4]; // up, down, left, right
+
+    Blocks(MPI_Comm parent, int N, int M, int px, int py) : px(px), py(py), rows(N, px), cols(M, py)
+    {
+        int dims[2] = {px, py}, periods[2] = {1, 1}, coords[2], rank;
+        MPI_Cart_create(parent, 2, dims, periods, 0, &comm);
+        MPI_Comm_rank(comm, &rank);
+        MPI_Cart_coords(comm, rank, 2, coords);
+        cx = coords[0];
+        cy = coords[1];
+        MPI_Cart_shift(comm, 0, 1, &neighbour[0], &neighbour[1]);
+        MPI_Cart_shift(comm, 1, 1, &neighbour[2], &neighbour[3]);
+    }
+
+    int owner(int x, int y) const
+    {
+        return rows.owner(x) * py + cols.owner(y);
+    }
+};
+
+// Open-addressing hash from cell (x * M + y) to the number of balls in it. Only the slots
+// filled during a step are reset afterwards, so counting costs O(local balls) per step no
+// matter how large the grid is.
+struct CellCounter
+{
+    int64_t M;
+    std::vector<int64_t> keys;
+    std::vector<int> counts;
+    std::vector<size_t> used;
+    size_t mask = 0;
+    int shift = 64;
+
+    CellCounter(int M) : M(M) {}
+
+    // the hash covers any rows, so a new slab needs nothing
+    void set_rows(int, int) {}
+
+    // make room for n distinct cells, keeping the ones already counted
+    void reserve(size_t n)
+    {
+        if (!keys.empty() && 2 * n <= keys.size())
+        {
+            return;
+        }
+
+        size_t capacity = 16;
+        shift = 60;
+        while (capacity < 2 * n)
+        {
+            capacity *= 2;
+            shift--;
+        }
+
+        std::vector<int64_t> old_keys(capacity, -1);
+        std::vector<int> old_counts(capacity, 0);
+        std::vector<size_t> old_used;
+        old_keys.swap(keys);
+        old_counts.swap(counts);
+        old_used.swap(used);
+        mask = capacity - 1;
+
+        for (size_t slot : old_used)
+        {
+            slot_of(old_keys[slot]);
+            counts[used.back()] = old_counts[slot];
+        }
+    }
+
+    // slot holding key, claiming an empty one if the key is new
+    size_t slot_of(int64_t key)
+    {
+        size_t slot = (uint64_t)key * 0x9E3779B97F4A7C15ull >> shift;
+        while (keys[slot] != key)
+        {
+            if (keys[slot] == -1)
+            {
+                keys[slot] = key;
+                used.push_back(slot);
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void add(int x, int y)
+    {
+        counts[slot_of(x * M + y)]++;
+    }
+
+    int count(int x, int y)
+    {
+        return counts[slot_of(x * M + y)];
+    }
+
+    void clear()
+    {
+        for (size_t slot : used)
+        {
+            keys[slot] = -1;
+            counts[slot] = 0;
+        }
+        used.clear();
+    }
+};
+
+// Dense counts for the block this rank owns only, [row_begin, row_end) x [col_begin, col_end),
+// indexed with row and column offsets. The cells touched in a step are kept in a dirty list and
+// only those are reset, so clearing costs O(local balls) while memory scales with N * M / P.
+struct DenseGrid
+{
+    int64_t width, row_begin, col_begin;
+    std::vector<int> counts;
+    std::vector<int64_t> dirty;
+
+    DenseGrid(int row_begin, int row_end, int col_begin, int col_end) : width(col_end - col_begin), col_begin(col_begin)
+    {
+        set_rows(row_begin, row_end);
+    }
+
+    // move to a new slab of owned rows; the last step's counts are still in place and its dirty
+    // cells index the old slab, so both are dropped and the new grid starts zeroed
+    void set_rows(int begin, int end)
+    {
+        row_begin = begin;
+        dirty.clear();
+        counts.assign((int64_t)(end - begin) * width, 0);
+    }
+
+    void reserve(size_t n)
+    {
+        dirty.reserve(n);
+    }
+
+    void add(int x, int y)
+    {
+        int64_t cell = (x - row_begin) * width + (y - col_begin);
+        if (counts[cell]++ == 0)
+        {
+            dirty.push_back(cell);
+        }
+    }
+
+    int count(int x, int y)
+    {
+        return counts[(x - row_begin) * width + (y - col_begin)];
+    }
+
+    void clear()
+    {
+        for (int64_t cell : dirty)
+        {
+            counts[cell] = 0;
+        }
+        dirty.clear();
+    }
+};
+
+// Keeps the local balls themselves sorted by cell instead of counting into a table: balls
+// sharing a cell end up next to each other, so the collision counts are the lengths of runs of
+// equal cells, found in one linear scan. The balls are counting-sorted by row and then sorted by
+// column within each row; a row's balls arrive there as the few sorted runs of the rows it was
+// fed from, so the short rows are finished with an insertion sort. Balls received afterwards are
+// sorted on their own and merged in behind the rest.
+struct CellSorter
+{
+    int row_begin;
+    std::vector<int> row_end, order;
+    BallSet scratch;
+
+    CellSorter(int row_begin, int row_end)
+    {
+        set_rows(row_begin, row_end);
+    }
+
+    void set_rows(int begin, int end)
+    {
+        row_begin = begin;
+        row_end.assign(end - begin, 0);
+    }
+
+    // sorts balls[from, size) by cell and merges it into the sorted balls[0, from)
+    void sort(BallSet &balls, size_t from)
+    {
+        size_t n = balls.size();
+        order.resize(n - from);
+        auto by_cell = [&](int a, int b)
+        { return balls.x[a] < balls.x[b] || (balls.x[a] == balls.x[b] && balls.y[a] < balls.y[b]); };
+
+        if (from == 0)
+        {
+            // stable counting sort by row; afterwards row_end[r] is where row r ends
+            std::fill(row_end.begin(), row_end.end(), 0);
+            for (size_t i = 0; i < n; i++)
+            {
+                row_end[balls.x[i] - row_begin]++;
+            }
+            for (size_t r = 1; r < row_end.size(); r++)
+            {
+                row_end[r] += row_end[r - 1];
+            }
+            for (size_t i = n; i-- > 0;)
+            {
+                order[--row_end[balls.x[i] - row_begin]] = i;
+            }
+            for (size_t r = 0; r < row_end.size(); r++)
+            {
+                row_end[r] = r + 1 < row_end.size() ? row_end[r + 1] : n;
+            }
+
+            // then by column within each row
+            size_t begin = 0;
+            for (size_t r = 0; r < row_end.size(); begin = row_end[r++])
+            {
+                auto first = order.begin() + begin, last = order.begin() + row_end[r];
+                if (last - first > 32)
+                {
+                    std::sort(first, last, by_cell);
+                    continue;
+                }
+                for (auto i = first + 1; i < last; i++)
+                {
+                    int ball = *i;
+                    auto j = i;
+                    for (; j > first && by_cell(ball, *(j - 1)); j--)
+                    {
+                        *j = *(j - 1);
+                    }
+                    *j = ball;
+                }
+            }
+
+            scratch.resize(n);
+            for (size_t i = 0; i < n; i++)
+            {
+                int k = order[i];
+                scratch.id[i] = balls.id[k];
+                scratch.x[i] = balls.x[k];
+                scratch.y[i] = balls.y[k];
+                scratch.d[i] = balls.d[k];
+            }
+            balls.swap(scratch);
+            return;
+        }
+
+        // the received balls are few: sort them aside, then merge from the back in place
+        for (size_t i = from; i < n; i++)
+        {
+            order[i - from] = i;
+        }
+        std::sort(order.begin(), order.end(), by_cell);
+        scratch.resize(n - from);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            int k = order[i];
+            scratch.id[i] = balls.id[k];
+            scratch.x[i] = balls.x[k];
+            scratch.y[i] = balls.y[k];
+            scratch.d[i] = balls.d[k];
+        }
+
+        size_t a = from, b = n - from, out = n;
+        while (b > 0)
+        {
+            bool take_old = a > 0 && (balls.x[a - 1] > scratch.x[b - 1] ||
+                                      (balls.x[a - 1] == scratch.x[b - 1] && balls.y[a - 1] > scratch.y[b - 1]));
+            out--;
+            if (take_old)
+            {
+                a--;
+                balls.id[out] = balls.id[a];
+                balls.x[out] = balls.x[a];
+                balls.y[out] = balls.y[a];
+                balls.d[out] = balls.d[a];
+            }
+            else
+            {
+                b--;
+                balls.id[out] = scratch.id[b];
+                balls.x[out] = scratch.x[b];
+                balls.y[out] = scratch.y[b];
+                balls.d[out] = scratch.d[b];
+            }
+        }
+    }
+};
+
+const int dx[4] = {-1, 0, 1, 0};
+const int dy[4] = {0, 1, 0, -1};
+const int dd[4] = {0, 1, 0, 2};
+
+// The cells of a block that migrants can land in: its first and last rows when the rows are
+// split over ranks, and its first and last columns when the columns are. Counts anywhere else
+// are final once the balls that stayed have been counted.
+struct Edge
+{
+    int row_begin, row_end, col_begin, col_end;
+    bool rows, cols;
+
+    bool contains(int x, int y) const
+    {
+        return (rows && (x == row_begin || x == row_end - 1)) || (cols && (y == col_begin || y == col_end - 1));
+    }
+};
+
+// Collision counting for the per-step loop: count_balls takes in balls[from, size) after the
+// rest, starting afresh when from is 0. count_inner gives every ball off the edge the number of
+// balls in its cell and every ball on it 1, which the dd rule leaves unturned, and notes the
+// latter in edge_balls; turn_edge then turns those and the balls from `from` on, once all have
+// been counted. The tables count cell by cell; the sorter reorders the balls and counts runs.
+template <typename Counter>
+void count_balls(Counter &cells, BallSet &balls, size_t from)
+{
+    if (from == 0)
+    {
+        cells.clear();
+    }
+    cells.reserve(balls.size());
+    for (size_t i = from; i < balls.size(); i++)
+    {
+        cells.add(balls.x[i], balls.y[i]);
+    }
+}
+
+template <typename Counter>
+void count_inner(Counter &cells, const BallSet &balls, std::vector<int> &hits, const Edge &edge,
+                 std::vector<int> &edge_balls)
+{
+    edge_balls.clear();
+    for (size_t i = 0; i < balls.size(); i++)
+    {
+        if (edge.contains(balls.x[i], balls.y[i]))
+        {
+            hits[i] = 1;
+            edge_balls.push_back(i);
+        }
+        else
+        {
+            hits[i] = cells.count(balls.x[i], balls.y[i]);
+        }
+    }
+}
+
+template <typename Counter>
+void turn_edge(Counter &cells, BallSet &balls, const Edge &, const std::vector<int> &edge_balls, size_t from)
+{
+    for (int i : edge_balls)
+    {
+        balls.d[i] = (balls.d[i] + dd[cells.count(balls.x[i], balls.y[i]) - 1]) & 3;
+    }
+    for (size_t i = from; i < balls.size(); i++)
+    {
+        balls.d[i] = (balls.d[i] + dd[cells.count(balls.x[i], balls.y[i]) - 1]) & 3;
+    }
+}
+
+void count_balls(CellSorter &cells, BallSet &balls, size_t from)
+{
+    cells.sort(balls, from);
+}
+
+// the merge moves the balls around, so the sorter finds the edge again from the runs
+void count_inner(CellSorter &, const BallSet &balls, std::vector<int> &hits, const Edge &edge, std::vector<int> &)
+{
+    for (size_t i = 0, j; i < balls.size(); i = j)
+    {
+        for (j = i + 1; j < balls.size() && balls.x[j] == balls.x[i] && balls.y[j] == balls.y[i]; j++)
+        {
+        }
+        std::fill(hits.begin() + i, hits.begin() + j, edge.contains(balls.x[i], balls.y[i]) ? 1 : j - i);
+    }
+}
+
+void turn_edge(CellSorter &, BallSet &balls, const Edge &edge, const std::vector<int> &, size_t)
+{
+    for (size_t i = 0, j; i < balls.size(); i = j)
+    {
+        for (j = i + 1; j < balls.size() && balls.x[j] == balls.x[i] && balls.y[j] == balls.y[i]; j++)
+        {
+        }
+        if (edge.contains(balls.x[i], balls.y[i]))
+        {
+            for (size_t k = i; k < j; k++)
+            {
+                balls.d[k] = (balls.d[k] + dd[j - i - 1]) & 3;
+            }
+        }
+    }
+}
+
+// Moves n balls one cell with toroidal wrap and records where each one belongs now:
+// 0 stays in the owned rows [row_begin, row_end), 1 goes to the rank above, 2 to the rank below.
+// Balls only change rows when moving U or D, so leaving the slab upwards means the rank above.
+void move_kernel_scalar(int *x, int *y, const int *d, int *dest, size_t n, int N, int M, int row_begin, int row_end)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        int nx = x[i] + dx[d[i]];
+        int ny = y[i] + dy[d[i]];
+        nx = nx < 0 ? nx + N : (nx >= N ? nx - N : nx);
+        ny = ny < 0 ? ny + M : (ny >= M ? ny - M : ny);
+        x[i] = nx;
+        y[i] = ny;
+        dest[i] = (nx < row_begin || nx >= row_end) ? (d[i] == 0 ? 1 : 2) : 0;
+    }
+}
+
+// Turns n balls by the dd rule given the number of balls sharing their cell
+void turn_kernel_scalar(int *d, const int *count, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        d[i] = (d[i] + dd[count[i] - 1]) & 3;
+    }
+}
+
+// Eight balls per instruction, with compare-and-select in place of the table lookups and the
+// modulo wrap. Built when compiling with -mavx2 (or -march=native on an AVX2 machine).
+#ifdef __AVX2__
+void move_kernel(int *x, int *y, const int *d, int *dest, size_t n, int N, int M, int row_begin, int row_end)
+{
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2), three = _mm256_set1_epi32(3);
+    const __m256i vN = _mm256_set1_epi32(N), vM = _mm256_set1_epi32(M);
+    const __m256i begin = _mm256_set1_epi32(row_begin), end = _mm256_set1_epi32(row_end);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i vd = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i vx = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i vy = _mm256_loadu_si256((const __m256i *)(y + i));
+
+        // comparison masks are -1 where true, so adding a mask steps back and subtracting steps forward
+        __m256i up = _mm256_cmpeq_epi32(vd, zero);
+        vx = _mm256_sub_epi32(_mm256_add_epi32(vx, up), _mm256_cmpeq_epi32(vd, two));
+        vy = _mm256_add_epi32(_mm256_sub_epi32(vy, _mm256_cmpeq_epi32(vd, one)), _mm256_cmpeq_epi32(vd, three));
+
+        vx = _mm256_add_epi32(vx, _mm256_and_si256(_mm256_cmpgt_epi32(zero, vx), vN));
+        vx = _mm256_sub_epi32(vx, _mm256_andnot_si256(_mm256_cmpgt_epi32(vN, vx), vN));
+        vy = _mm256_add_epi32(vy, _mm256_and_si256(_mm256_cmpgt_epi32(zero, vy), vM));
+        vy = _mm256_sub_epi32(vy, _mm256_andnot_si256(_mm256_cmpgt_epi32(vM, vy), vM));
+
+        _mm256_storeu_si256((__m256i *)(x + i), vx);
+        _mm256_storeu_si256((__m256i *)(y + i), vy);
+
+        // outside the slab: 2 + up gives 1 for balls moving up and 2 for the rest
+        __m256i inside = _mm256_andnot_si256(_mm256_cmpgt_epi32(begin, vx), _mm256_cmpgt_epi32(end, vx));
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_andnot_si256(inside, _mm256_add_epi32(two, up)));
+    }
+    move_kernel_scalar(x + i, y + i, d + i, dest + i, n - i, N, M, row_begin, row_end);
+}
+
+void turn_kernel(int *d, const int *count, size_t n)
+{
+    const __m256i table = _mm256_setr_epi32(dd[0], dd[1], dd[2], dd[3], 0, 0, 0, 0);
+    const __m256i one = _mm256_set1_epi32(1), three = _mm256_set1_epi32(3);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i vd = _mm256_loadu_si256((const __m256i *)(d + i));
+        __m256i vc = _mm256_loadu_si256((const __m256i *)(count + i));
+        __m256i turn = _mm256_permutevar8x32_epi32(table, _mm256_sub_epi32(vc, one));
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_and_si256(_mm256_add_epi32(vd, turn), three));
+    }
+    turn_kernel_scalar(d + i, count + i, n - i);
+}
+#else
+void move_kernel(int *x, int *y, const int *d, int *dest, size_t n, int N, int M, int row_begin, int row_end)
+{
+    move_kernel_scalar(x, y, d, dest, n, N, M, row_begin, row_end);
+}
+
+void turn_kernel(int *d, const int *count, size_t n)
+{
+    turn_kernel_scalar(d, count, n);
+}
+#endif
+
+// Times the move and turn kernels over K random balls for R steps on one rank, without any
+// communication or collision counting, and prints the throughput of both variants
+void bench_kernels(int K, int R)
+{
+    const int N = 1 << 16, M = 1 << 16;
+    std::mt19937 rng(2021111003);
+    std::vector<int> x0(K), y0(K), d0(K), count(K), dest(K);
+    for (int i = 0; i < K; i++)
+    {
+        x0[i] = rng() % N;
+        y0[i] = rng() % M;
+        d0[i] = rng() % 4;
+        count[i] = 1 + rng() % 4;
+    }
+
+    for (int variant = 0; variant < 2; variant++)
+    {
+        std::vector<int> x = x0, y = y0, d = d0;
+        double start = MPI_Wtime();
+        for (int r = 0; r < R; r++)
+        {
+            if (variant == 0)
+            {
+                move_kernel(x.data(), y.data(), d.data(), dest.data(), K, N, M, 0, N / 2);
+                turn_kernel(d.data(), count.data(), K);
+            }
+            else
+            {
+                move_kernel_scalar(x.data(), y.data(), d.data(), dest.data(), K, N, M, 0, N / 2);
+                turn_kernel_scalar(d.data(), count.data(), K);
+            }
+        }
+        double elapsed = MPI_Wtime() - start;
+
+#ifdef __AVX2__
+        const char *name = variant == 0 ? "avx2" : "scalar";
+#else
+        const char *name = variant == 0 ? "default (scalar build)" : "scalar";
+#endif
+        std::cout << name << " kernels: " << (double)K * R / elapsed << " balls/s (" << K << " balls, " << R
+                  << " steps, checksum " << (x[0] + y[K / 2] + d[K - 1]) << ")" << std::endl;
+    }
+}
+
+uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Order-independent hash of the global ball state: every ball is hashed on its own and the
+// hashes are summed, locally and then across ranks with one Allreduce
+uint64_t state_hash(const BallSet &balls)
+{
+    uint64_t hash = 0;
+    for (size_t i = 0; i < balls.size(); i++)
+    {
+        uint64_t cell = mix64(((uint64_t)(uint32_t)balls.x[i] << 32) | (uint32_t)balls.y[i]);
+        hash += mix64(cell ^ mix64((uint64_t)(uint32_t)balls.id[i] << 2 | balls.d[i]));
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &hash, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    return hash;
+}
+
+// Cycle detection over the global state. The state is hashed at every check and compared
+// against the states kept at the 1st, 2nd, 4th, 8th, ... check; the first checkpoint at or past
+// the start of the cycle is matched one cycle length later, and the run then skips ahead by a
+// whole number of cycles.
+struct CycleFinder
+{
+    std::vector<std::pair<uint64_t, int>> checkpoints;
+    int checks = 0;
+    bool done = false;
+
+    // called with the state after step; shortens T once a repeat is found
+    void check(const BallSet &balls, int step, int &T, int world_rank)
+    {
+        uint64_t hash = state_hash(balls);
+        for (const auto &checkpoint : checkpoints)
+        {
+            if (checkpoint.first == hash)
+            {
+                int length = step - checkpoint.second;
+                T = step + (T - step) % length;
+                done = true;
+                if (world_rank == 0)
+                {
+                    std::cerr << "cycle: step " << step << " repeats step " << checkpoint.second << ", length "
+                              << length << ", " << T - step << " steps left" << std::endl;
+                }
+                return;
+            }
+        }
+        checks++;
+        if ((checks & (checks - 1)) == 0)
+        {
+            checkpoints.push_back({hash, step});
+        }
+    }
+};
+
+#ifdef COUNT_ALLOCATIONS
+// calls to operator new so far, counted by alloc_count.cpp in the profiling build
+extern uint64_t heap_allocations;
+const bool count_allocations = true;
+#else
+const uint64_t heap_allocations = 0;
+const bool count_allocations = false;
+#endif
+
+// Timestamp for the profiling counters: the cycle counter on x86, a steady clock in
+// nanoseconds elsewhere
+uint64_t ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Per-rank time spent in each part of a step, in ticks, plus the number of balls sent away and,
+// in a build with COUNT_ALLOCATIONS, of operator new calls. A lap charges the ticks since the
+// previous one to a phase, so a step costs a handful of timestamp reads. Every `every` steps the
+// counters are reduced to min / mean / max over the ranks and rank 0 prints them per step in
+// microseconds, with ticks converted using its own tick rate over the run so far; a wide min-max
+// gap shows imbalance, and a large exchange share shows ranks stalled on their neighbours.
+struct StepProfile
+{
+    enum Phase
+    {
+        MOVE,     // move kernel, sorting out the leavers and packing them per link
+        EXCHANGE, // copying into the messages, posting and waiting on them
+        COUNT,    // filling the cell counter
+        COLLIDE,  // looking up counts and turning
+        OTHER,    // rebalancing, cycle checks, snapshots
+        PHASES,
+        MIGRATED = PHASES,
+        ALLOCATED,
+        COUNTERS
+    };
+
+    int every, steps = 0, first_step = 0;
+    uint64_t stamp, start_ticks, start_allocations = heap_allocations;
+    double start_time, counters[COUNTERS] = {};
+
+    StepProfile(int every) : every(every)
+    {
+        start_ticks = ticks();
+        start_time = MPI_Wtime();
+        stamp = start_ticks;
+    }
+
+    void lap(Phase phase)
+    {
+        uint64_t now = ticks();
+        counters[phase] += now - stamp;
+        stamp = now;
+    }
+
+    void migrated(size_t n)
+    {
+        counters[MIGRATED] += n;
+    }
+
+    // called by every rank after each step
+    void end_step(int world_rank)
+    {
+        if (++steps < every)
+        {
+            return;
+        }
+
+        counters[ALLOCATED] = heap_allocations - start_allocations;
+        double low[COUNTERS], sum[COUNTERS], high[COUNTERS];
+        int world_size;
+        MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+        MPI_Reduce(counters, low, COUNTERS, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+        MPI_Reduce(counters, sum, COUNTERS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Reduce(counters, high, COUNTERS, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+        if (world_rank == 0)
+        {
+            const char *names[COUNTERS] = {"move", "exchange", "count", "collide", "other", "migrated", "allocated"};
+            double us_per_tick = 1e6 * (MPI_Wtime() - start_time) / std::max<uint64_t>(1, ticks() - start_ticks);
+            std::cerr << "profile steps " << first_step << "-" << first_step + steps << " per step, min/mean/max:";
+            for (int k = 0; k < (count_allocations ? COUNTERS : ALLOCATED); k++)
+            {
+                double scale = (k < PHASES ? us_per_tick : 1.0) / steps;
+                std::cerr << " " << names[k] << " " << low[k] * scale << "/" << sum[k] * scale / world_size << "/"
+                          << high[k] * scale << (k < PHASES ? "us" : "");
+            }
+            std::cerr << std::endl;
+        }
+
+        first_step += steps;
+        steps = 0;
+        std::fill(counters, counters + COUNTERS, 0.0);
+        start_allocations = heap_allocations;
+        stamp = ticks();
+    }
+};
+
+// Sends outgoing[r] to rank r for every r in one Alltoallv and returns what arrived
+std::vector<Ball> exchange_balls(const std::vector<std::vector<Ball>> &outgoing, MPI_Datatype MPI_BALL)
+{
+    int world_size = outgoing.size();
+    std::vector<int> send_counts(world_size), send_displs(world_size), recv_counts(world_size), recv_displs(world_size);
+    std::vector<Ball> send_balls;
+    for (int r = 0; r < world_size; r++)
+    {
+        send_counts[r] = outgoing[r].size();
+        send_displs[r] = send_balls.size();
+        send_balls.insert(send_balls.end(), outgoing[r].begin(), outgoing[r].end());
+    }
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    for (int r = 1; r < world_size; r++)
+    {
+        recv_displs[r] = recv_displs[r - 1] + recv_counts[r - 1];
+    }
+    std::vector<Ball> recv_balls(recv_displs[world_size - 1] + recv_counts[world_size - 1]);
+    MPI_Alltoallv(send_balls.data(), send_counts.data(), send_displs.data(), MPI_BALL,
+                  recv_balls.data(), recv_counts.data(), recv_displs.data(), MPI_BALL, MPI_COMM_WORLD);
+    return recv_balls;
+}
+
+// Text input: N M K T, then K lines "x y c" with c one of U, R, D, L; false if it runs short
+bool read_text(std::istream &in, int &N, int &M, int &K, int &T, std::vector<Ball> &balls)
+{
+    in >> N >> M >> K >> T;
+
+    for (int i = 0; i < K && in; i++)
+    {
+        int x, y, d;
+        char c;
+        in >> x >> y >> c;
+        if (c == 'U')
+            d = 0;
+        else if (c == 'R')
+            d = 1;
+        else if (c == 'D')
+            d = 2;
+        else
+            d = 3;
+
+        balls.push_back({i, x, y, d});
+    }
+    return (bool)in;
+}
+
+// one "x y c" line per ball, in the order given
+void print_balls(std::ostream &out, const std::vector<Ball> &balls)
+{
+    for (const auto &ball : balls)
+    {
+        out << ball.x << " " << ball.y << " ";
+        if (ball.d == 0)
+            out << "U";
+        else if (ball.d == 1)
+            out << "R";
+        else if (ball.d == 2)
+            out << "D";
+        else
+            out << "L";
+        out << "\n";
+    }
+}
+
+// Binary input: four int32 N, M, K, T, then K records of int32 x, y, d with d in 0..3 for U, R,
+// D, L and the ball id given by the record's position (2/convert.cpp writes it from the text
+// format). Every rank reads an equal contiguous share of the records collectively and hands
+// each ball to its owner in one Alltoallv, so no rank ever holds more than its share.
+void read_header(MPI_File file, int &N, int &M, int &K, int &T)
+{
+    int header[4];
+    MPI_File_read_at_all(file, 0, header, 4, MPI_INT, MPI_STATUS_IGNORE);
+    N = header[0];
+    M = header[1];
+    K = header[2];
+    T = header[3];
+}
+
+std::vector<Ball> read_balls(MPI_File file, const Blocks &blocks, int K, int world_size, int world_rank, MPI_Datatype MPI_BALL)
+{
+    int64_t first = (int64_t)K * world_rank / world_size;
+    int64_t last = (int64_t)K * (world_rank + 1) / world_size;
+    std::vector<int32_t> records(3 * (last - first));
+    MPI_File_read_at_all(file, (4 + 3 * first) * sizeof(int32_t), records.data(), records.size(), MPI_INT, MPI_STATUS_IGNORE);
+
+    std::vector<std::vector<Ball>> outgoing(world_size);
+    for (int64_t i = first; i < last; i++)
+    {
+        const int32_t *record = &records[3 * (i - first)];
+        outgoing[blocks.owner(record[0], record[1])].push_back({(int)i, record[0], record[1], record[2]});
+    }
+    std::vector<int32_t>().swap(records);
+    return exchange_balls(outgoing, MPI_BALL);
+}
+
+int64_t gcd64(int64_t a, int64_t b)
+{
+    while (b != 0)
+    {
+        a %= b;
+        std::swap(a, b);
+    }
+    return a;
+}
+
+// Synthetic workloads for benchmarking. Ball i depends only on (kind, seed, i), so every rank
+// makes its own contiguous share of the ids and any rank can remake the whole configuration.
+// Balls start in distinct cells of a region, picked by an affine permutation of its cells, as
+// the step rule only covers cells where every ball arrives from a different direction:
+//   uniform: the whole grid
+//   bands:   four bands of N / 64 rows each, the clustered case
+//   dense:   a block of about 2K cells, so collisions are frequent
+struct Workload
+{
+    int kind, N, M, band_rows = 1, bands = 1, width;
+    uint64_t seed;
+    int64_t cells, stride, shift;
+
+    Workload(int kind, uint64_t seed, int N, int M, int K) : kind(kind), N(N), M(M), width(M), seed(seed)
+    {
+        if (kind == 1)
+        {
+            bands = std::min(4, N);
+            band_rows = std::max(1, N / 64);
+            cells = (int64_t)bands * band_rows * M;
+        }
+        else if (kind == 2)
+        {
+            int side = 1;
+            while ((int64_t)side * side < 2 * (int64_t)K)
+            {
+                side++;
+            }
+            int rows = std::min(side, N);
+            width = (int)std::min<int64_t>(M, std::max<int64_t>(1, (2 * (int64_t)K + rows - 1) / rows));
+            cells = (int64_t)rows * width;
+        }
+        else
+        {
+            cells = (int64_t)N * M;
+        }
+
+        stride = mix64(seed) % cells | 1;
+        while (gcd64(stride, cells) != 1)
+        {
+            stride++;
+        }
+        shift = mix64(seed + 1) % cells;
+    }
+
+    Ball ball(int i) const
+    {
+        int64_t cell = (int64_t)(((__int128)i * stride + shift) % cells);
+        int64_t row = cell / width;
+        int y = cell % width;
+        int x = kind == 1 ? (int)((row / band_rows) * N / bands + row % band_rows) : (int)row;
+        return {i, x, y, (int)(mix64(seed ^ mix64(i)) & 3)};
+    }
+};
+
+std::vector<Ball> generate_balls(const Workload &workload, const Blocks &blocks, int K, int world_size, int world_rank,
+                                 MPI_Datatype MPI_BALL)
+{
+    int first = (int64_t)K * world_rank / world_size;
+    int last = (int64_t)K * (world_rank + 1) / world_size;
+    std::vector<std::vector<Ball>> outgoing(world_size);
+    for (int i = first; i < last; i++)
+    {
+        Ball ball = workload.ball(i);
+        outgoing[blocks.owner(ball.x, ball.y)].push_back(ball);
+    }
+    return exchange_balls(outgoing, MPI_BALL);
+}
+
+// Plain serial version of the step rules, for checking small runs
+void reference_simulate(std::vector<Ball> &balls, int N, int M, int T)
+{
+    std::map<int64_t, int> counts;
+    for (int t = 0; t < T; t++)
+    {
+        counts.clear();
+        for (auto &ball : balls)
+        {
+            ball.x = (ball.x + dx[ball.d] + N) % N;
+            ball.y = (ball.y + dy[ball.d] + M) % M;
+            counts[(int64_t)ball.x * M + ball.y]++;
+        }
+        for (auto &ball : balls)
+        {
+            ball.d = (ball.d + dd[counts[(int64_t)ball.x * M + ball.y] - 1]) % 4;
+        }
+    }
+}
+
+// Trajectory snapshots: four int32 N, M, K, S, then one frame of K records of int32 id, x, y, d
+// at steps 0, S, 2S, ... . Within a frame every rank writes its balls at its own offset, the
+// exclusive prefix sum of the local counts, so frames are in rank order rather than id order.
+// The writes are nonblocking collectives from two alternating buffers, so a frame is written
+// while the next S steps run and a buffer is only waited on when its turn comes again.
+struct SnapshotWriter
+{
+    MPI_File file;
+    MPI_Datatype MPI_BALL;
+    int K, every, frames = 0;
+    std::vector<Ball> buffers[2];
+    MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+
+    SnapshotWriter(const char *path, int N, int M, int K, int every, int world_rank, MPI_Datatype MPI_BALL)
+        : MPI_BALL(MPI_BALL), K(K), every(every)
+    {
+        if (MPI_File_open(MPI_COMM_WORLD, path, MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        {
+            if (world_rank == 0)
+            {
+                std::cerr << "cannot open " << path << std::endl;
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        MPI_File_set_size(file, 0);
+        if (world_rank == 0)
+        {
+            int header[4] = {N, M, K, every};
+            MPI_File_write_at(file, 0, header, 4, MPI_INT, MPI_STATUS_IGNORE);
+        }
+    }
+
+    void write(const BallSet &balls)
+    {
+        int slot = frames % 2;
+        MPI_Wait(&requests[slot], MPI_STATUS_IGNORE);
+
+        std::vector<Ball> &buffer = buffers[slot];
+        buffer.resize(balls.size());
+        for (size_t i = 0; i < balls.size(); i++)
+        {
+            buffer[i] = {balls.id[i], balls.x[i], balls.y[i], balls.d[i]};
+        }
+
+        int64_t count = balls.size(), before = 0;
+        MPI_Exscan(&count, &before, 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+        int world_rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+        if (world_rank == 0)
+        {
+            before = 0;
+        }
+
+        MPI_Offset offset = 4 * sizeof(int32_t) + ((int64_t)frames * K + before) * sizeof(Ball);
+        MPI_File_iwrite_at_all(file, offset, buffer.data(), count, MPI_BALL, &requests[slot]);
+        frames++;
+    }
+
+    void close()
+    {
+        MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+        MPI_File_close(&file);
+    }
+};
+
+// Moves the row boundaries so every rank holds about the same number of balls and migrates
+// the balls to their new owners. The per-row histogram is summed over all ranks, so every
+// rank derives the same boundaries from its prefix sums.
+void rebalance(BallSet &my_balls, RowSplit &rows, int N, int world_size, int world_rank, MPI_Datatype MPI_BALL)
+{
+    std::vector<int64_t> histogram(N, 0);
+    for (size_t i = 0; i < my_balls.size(); i++)
+    {
+        histogram[my_balls.x[i]]++;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, histogram.data(), N, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+    // rank r starts at the first row with at least r / world_size of the balls above it,
+    // clamped so that every rank keeps at least one row
+    int64_t total = 0;
+    for (int64_t count : histogram)
+    {
+        total += count;
+    }
+    int64_t above = 0;
+    int x = 0;
+    for (int r = 1; r < world_size; r++)
+    {
+        int64_t target = (total * r + world_size - 1) / world_size;
+        while (x < N && above < target)
+        {
+            above += histogram[x++];
+        }
+        rows.begin[r] = std::min(std::max(x, rows.begin[r - 1] + 1), N - (world_size - r));
+    }
+
+    // send every ball that changed owner straight to its new rank
+    std::vector<std::vector<Ball>> outgoing(world_size);
+    size_t kept = 0;
+    for (size_t i = 0; i < my_balls.size(); i++)
+    {
+        int owner = rows.owner(my_balls.x[i]);
+        if (owner != world_rank)
+        {
+            outgoing[owner].push_back({my_balls.id[i], my_balls.x[i], my_balls.y[i], my_balls.d[i]});
+            continue;
+        }
+        my_balls.id[kept] = my_balls.id[i];
+        my_balls.x[kept] = my_balls.x[i];
+        my_balls.y[kept] = my_balls.y[i];
+        my_balls.d[kept] = my_balls.d[i];
+        kept++;
+    }
+    my_balls.resize(kept);
+    my_balls.append(exchange_balls(outgoing, MPI_BALL));
+}
+
+// Runs T steps on the local balls, counting the balls per cell with cells. Balls leaving the
+// block go to one of the four face neighbours; a ball moves along one axis at a time, so it
+// never needs a diagonal one. With detect_cycle the global state is checked for a repeat after
+// every step, with rebalance_every > 0 the row boundaries follow the ball density every that
+// many steps (row slabs only), with snapshots the state goes out every snapshots->every steps,
+// and with profile the time spent in each phase is recorded.
+//
+// Migration takes a single round per step: every link to a face neighbour carries one
+// message of at most a fixed capacity whose first record holds the number of balls in its id,
+// so the receive can be posted before the count is known. The balls that do not fit follow in a
+// second message on the rare steps that need one. Both ends of a link see the same counts, so
+// they grow its capacity to twice an overflowing count in lockstep without talking.
+template <typename Counter>
+void simulate(BallSet &my_balls, Counter &cells, Blocks &blocks, int N, int M, int T, int world_rank,
+              MPI_Datatype MPI_BALL, bool detect_cycle, int rebalance_every, SnapshotWriter *snapshots,
+              StepProfile *profile)
+{
+    CycleFinder cycle;
+    if (snapshots)
+    {
+        snapshots->write(my_balls);
+    }
+
+    // the exchange buffers live across steps and only grow, so a steady step does not allocate.
+    // Link j leads to neighbour[j]: up, down, left, right. Balls moving U, D, L, R go out on
+    // links 0, 1, 2, 3, and link j ^ 1 is the opposite side, so what a rank sends on link j
+    // arrives on the neighbour's link j ^ 1.
+    // Balls travel packed, so the capacities count balls and the buffers words.
+    std::vector<uint64_t> send_balls[4], overflow_balls[4], send_buffer, recv_buffer;
+    std::vector<int> dest, hits, edge_balls;
+    int64_t local_count = my_balls.size(), K;
+    MPI_Allreduce(&local_count, &K, 1, MPI_INT64_T, MPI_SUM, blocks.comm);
+    const BallPacking packing(N, M, K);
+    const int w = packing.words;
+    int send_capacity[4], recv_capacity[4], send_displs[4], recv_displs[4];
+
+    // only the dimensions split over more than one rank exchange anything
+    bool active[4] = {blocks.px > 1, blocks.px > 1, blocks.py > 1, blocks.py > 1};
+    for (int j = 0; j < 4; j++)
+    {
+        send_capacity[j] = recv_capacity[j] = 16;
+    }
+
+    // Every active link has a persistent receive of a count word plus a full capacity of balls,
+    // so a step only starts it; it is rebuilt on a new buffer when the capacity grows. Sends
+    // carry just the count word and the balls that fit, which a longer posted receive accepts,
+    // so one burst does not make every later message as large. Tags are the sender's link index,
+    // received on link j as j ^ 1, which tells the two links apart when both lead to the same
+    // rank, and link + 4 marks the overflow.
+    MPI_Request send_requests[4], recv_requests[4], overflow_sends[4], overflow_recvs[4];
+    int links = 0;
+    auto setup_links = [&]()
+    {
+        int send_total = 0, recv_total = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            send_displs[j] = send_total;
+            recv_displs[j] = recv_total;
+            if (active[j])
+            {
+                send_total += 1 + send_capacity[j] * w;
+                recv_total += 1 + recv_capacity[j] * w;
+            }
+        }
+        send_buffer.resize(send_total);
+        recv_buffer.resize(recv_total);
+
+        for (int i = 0; i < links; i++)
+        {
+            MPI_Request_free(&recv_requests[i]);
+        }
+        links = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            if (active[j])
+            {
+                MPI_Recv_init(recv_buffer.data() + recv_displs[j], 1 + recv_capacity[j] * w, MPI_UINT64_T,
+                              blocks.neighbour[j], j ^ 1, blocks.comm, &recv_requests[links]);
+                links++;
+            }
+        }
+    };
+    setup_links();
+
+    int row_begin = blocks.rows.begin[blocks.cx];
+    int row_end = blocks.rows.begin[blocks.cx + 1];
+    int col_begin = blocks.cols.begin[blocks.cy];
+    int col_end = blocks.cols.begin[blocks.cy + 1];
+
+    for (int t = 0; t < T; t++)
+    {
+        if (rebalance_every > 0 && t > 0 && t % rebalance_every == 0)
+        {
+            rebalance(my_balls, blocks.rows, N, blocks.px, world_rank, MPI_BALL);
+            row_begin = blocks.rows.begin[blocks.cx];
+            row_end = blocks.rows.begin[blocks.cx + 1];
+            cells.set_rows(row_begin, row_end);
+        }
+        if (profile)
+        {
+            profile->lap(StepProfile::OTHER);
+        }
+
+        for (int dir = 0; dir < 4; dir++)
+        {
+            send_balls[dir].clear();
+        }
+
+        // Update positions and determine ownership; the kernel only checks rows, so balls
+        // that stayed in them but left the columns are sorted out here
+        dest.resize(my_balls.size());
+        move_kernel(my_balls.x.data(), my_balls.y.data(), my_balls.d.data(), dest.data(), my_balls.size(), N, M, row_begin, row_end);
+
+        // compact the staying balls in one pass
+        size_t kept = 0;
+        for (size_t i = 0; i < my_balls.size(); i++)
+        {
+            int to = dest[i];
+            if (to == 0 && (my_balls.y[i] < col_begin || my_balls.y[i] >= col_end))
+            {
+                to = my_balls.d[i] == 3 ? 3 : 4;
+            }
+
+            if (to != 0)
+            {
+                packing.pack(my_balls, i, send_balls[to - 1]);
+            }
+            else
+            {
+                my_balls.id[kept] = my_balls.id[i];
+                my_balls.x[kept] = my_balls.x[i];
+                my_balls.y[kept] = my_balls.y[i];
+                my_balls.d[kept] = my_balls.d[i];
+                kept++;
+            }
+        }
+        if (profile)
+        {
+            profile->migrated(my_balls.size() - kept);
+            profile->lap(StepProfile::MOVE);
+        }
+        my_balls.resize(kept);
+
+        // start the receives, then send every active link a count word and as many balls as fit
+        MPI_Startall(links, recv_requests);
+        for (int j = 0; j < 4; j++)
+        {
+            send_requests[j] = overflow_sends[j] = overflow_recvs[j] = MPI_REQUEST_NULL;
+            if (!active[j])
+            {
+                continue;
+            }
+            int count = send_balls[j].size() / w, fit = std::min(count, send_capacity[j]);
+            send_buffer[send_displs[j]] = count;
+            std::copy(send_balls[j].begin(), send_balls[j].begin() + fit * w, send_buffer.begin() + send_displs[j] + 1);
+            MPI_Isend(send_buffer.data() + send_displs[j], 1 + fit * w, MPI_UINT64_T, blocks.neighbour[j], j,
+                      blocks.comm, &send_requests[j]);
+            if (count > fit)
+            {
+                MPI_Isend(send_balls[j].data() + fit * w, (count - fit) * w, MPI_UINT64_T, blocks.neighbour[j], 4 + j,
+                          blocks.comm, &overflow_sends[j]);
+            }
+        }
+
+        if (profile)
+        {
+            profile->lap(StepProfile::EXCHANGE);
+        }
+
+        // Handle collisions. Migrants only land on the edge of the block, so the balls off it
+        // can be turned while the messages are in flight; the edge waits for the arrivals.
+        count_balls(cells, my_balls, 0);
+        if (profile)
+        {
+            profile->lap(StepProfile::COUNT);
+        }
+        const Edge edge = {row_begin, row_end, col_begin, col_end, active[0], active[2]};
+        hits.resize(my_balls.size());
+        count_inner(cells, my_balls, hits, edge, edge_balls);
+        turn_kernel(my_balls.d.data(), hits.data(), my_balls.size());
+        if (profile)
+        {
+            profile->lap(StepProfile::COLLIDE);
+        }
+
+        MPI_Waitall(links, recv_requests, MPI_STATUSES_IGNORE);
+        if (profile)
+        {
+            profile->lap(StepProfile::EXCHANGE);
+        }
+
+        // Update local state
+        int recv_counts[4] = {0, 0, 0, 0};
+        for (int j = 0; j < 4; j++)
+        {
+            if (!active[j])
+            {
+                continue;
+            }
+            recv_counts[j] = recv_buffer[recv_displs[j]];
+            int fit = std::min(recv_counts[j], recv_capacity[j]);
+            if (recv_counts[j] > fit)
+            {
+                overflow_balls[j].resize((recv_counts[j] - fit) * w);
+                MPI_Irecv(overflow_balls[j].data(), overflow_balls[j].size(), MPI_UINT64_T, blocks.neighbour[j], 4 + (j ^ 1),
+                          blocks.comm, &overflow_recvs[j]);
+            }
+
+            packing.unpack(recv_buffer.data() + recv_displs[j] + 1, fit, my_balls);
+        }
+        for (int j = 0; j < 4; j++)
+        {
+            if (overflow_recvs[j] != MPI_REQUEST_NULL)
+            {
+                MPI_Wait(&overflow_recvs[j], MPI_STATUS_IGNORE);
+                packing.unpack(overflow_balls[j].data(), overflow_balls[j].size() / w, my_balls);
+            }
+        }
+        count_balls(cells, my_balls, kept);
+
+        if (profile)
+        {
+            profile->lap(StepProfile::COUNT);
+        }
+
+        // Process the collisions on the edge, which a single rank does not have
+        if (links > 0)
+        {
+            turn_edge(cells, my_balls, edge, edge_balls, kept);
+        }
+        if (profile)
+        {
+            profile->lap(StepProfile::COLLIDE);
+        }
+
+        // the send buffers are reused next step, and both ends of a link grow it the same way
+        MPI_Waitall(4, send_requests, MPI_STATUSES_IGNORE);
+        MPI_Waitall(4, overflow_sends, MPI_STATUSES_IGNORE);
+        bool grown = false;
+        for (int j = 0; j < 4; j++)
+        {
+            int sent = send_balls[j].size() / w;
+            if (sent > send_capacity[j])
+            {
+                send_capacity[j] = 2 * sent;
+                grown = true;
+            }
+            if (recv_counts[j] > recv_capacity[j])
+            {
+                recv_capacity[j] = 2 * recv_counts[j];
+                grown = true;
+            }
+        }
+        if (grown)
+        {
+            setup_links();
+        }
+        if (profile)
+        {
+            profile->lap(StepProfile::EXCHANGE);
+        }
+
+        if (detect_cycle && !cycle.done)
+        {
+            cycle.check(my_balls, t + 1, T, world_rank);
+        }
+        if (snapshots && (t + 1) % snapshots->every == 0)
+        {
+            snapshots->write(my_balls);
+        }
+        if (profile)
+        {
+            profile->lap(StepProfile::OTHER);
+            profile->end_step(world_rank);
+        }
+    }
+
+    for (int i = 0; i < links; i++)
+    {
+        MPI_Request_free(&recv_requests[i]);
+    }
+}
+
+// Communication-avoiding variant: once every k steps each rank sends the balls in its first
+// and last k rows to the neighbours, then simulates its rows plus the k ghost rows on either
+// side for k steps without talking to anyone. Information moves one row per step, so errors
+// from the missing balls beyond the ghost rows reach at most k - 1 rows in by the end of the
+// round and the owned rows come out exactly as in the per-step algorithm. Afterwards every
+// rank keeps the balls that ended in its own rows, so each ball survives on exactly one rank.
+// Needs k <= the smallest slab, and 2k <= it with two ranks so the two ghost zones do not overlap.
+void simulate_halo(BallSet &my_balls, const RowSplit &rows, int N, int M, int T, int k, int world_size, int world_rank,
+                   MPI_Datatype MPI_BALL, bool detect_cycle)
+{
+    CycleFinder cycle;
+    CellCounter cells(M);
+    std::vector<Ball> send_top_balls, send_bottom_balls, receive_top_balls, receive_bottom_balls;
+    std::vector<int> dest, hits;
+
+    int row_begin = rows.begin[world_rank];
+    int row_end = rows.begin[world_rank + 1];
+    int top = (world_rank - 1 + world_size) % world_size;
+    int bottom = (world_rank + 1) % world_size;
+
+    for (int t = 0; t < T;)
+    {
+        int steps = std::min(k, T - t);
+
+        if (world_size > 1)
+        {
+            send_top_balls.clear();
+            send_bottom_balls.clear();
+            for (size_t i = 0; i < my_balls.size(); i++)
+            {
+                if (my_balls.x[i] < row_begin + k)
+                {
+                    send_top_balls.push_back({my_balls.id[i], my_balls.x[i], my_balls.y[i], my_balls.d[i]});
+                }
+                if (my_balls.x[i] >= row_end - k)
+                {
+                    send_bottom_balls.push_back({my_balls.id[i], my_balls.x[i], my_balls.y[i], my_balls.d[i]});
+                }
+            }
+
+            int send_top_count = send_top_balls.size(), send_bottom_count = send_bottom_balls.size();
+            int top_count = 0, bottom_count = 0;
+            MPI_Sendrecv(&send_top_count, 1, MPI_INT, top, 0, &bottom_count, 1, MPI_INT, bottom, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            MPI_Sendrecv(&send_bottom_count, 1, MPI_INT, bottom, 0, &top_count, 1, MPI_INT, top, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            receive_top_balls.resize(top_count);
+            receive_bottom_balls.resize(bottom_count);
+            MPI_Request requests[4];
+            MPI_Irecv(receive_top_balls.data(), top_count, MPI_BALL, top, 1, MPI_COMM_WORLD, &requests[0]);
+            MPI_Irecv(receive_bottom_balls.data(), bottom_count, MPI_BALL, bottom, 2, MPI_COMM_WORLD, &requests[1]);
+            MPI_Isend(send_top_balls.data(), send_top_count, MPI_BALL, top, 2, MPI_COMM_WORLD, &requests[2]);
+            MPI_Isend(send_bottom_balls.data(), send_bottom_count, MPI_BALL, bottom, 1, MPI_COMM_WORLD, &requests[3]);
+            MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+            my_balls.append(receive_top_balls);
+            my_balls.append(receive_bottom_balls);
+        }
+
+        // k steps on owned and ghost balls alike; the slab bounds cover the whole grid so nothing is sent
+        for (int s = 0; s < steps; s++)
+        {
+            dest.resize(my_balls.size());
+            move_kernel(my_balls.x.data(), my_balls.y.data(), my_balls.d.data(), dest.data(), my_balls.size(), N, M, 0, N);
+
+            cells.clear();
+            cells.reserve(my_balls.size());
+            for (size_t i = 0; i < my_balls.size(); i++)
+            {
+                cells.add(my_balls.x[i], my_balls.y[i]);
+            }
+            hits.resize(my_balls.size());
+            for (size_t i = 0; i < my_balls.size(); i++)
+            {
+                hits[i] = cells.count(my_balls.x[i], my_balls.y[i]);
+            }
+            turn_kernel(my_balls.d.data(), hits.data(), my_balls.size());
+        }
+        t += steps;
+
+        // keep the balls that ended in the owned rows
+        size_t kept = 0;
+        for (size_t i = 0; i < my_balls.size(); i++)
+        {
+            if (my_balls.x[i] >= row_begin && my_balls.x[i] < row_end)
+            {
+                my_balls.id[kept] = my_balls.id[i];
+                my_balls.x[kept] = my_balls.x[i];
+                my_balls.y[kept] = my_balls.y[i];
+                my_balls.d[kept] = my_balls.d[i];
+                kept++;
+            }
+        }
+        my_balls.resize(kept);
+
+        if (detect_cycle && !cycle.done)
+        {
+            cycle.check(my_balls, t, T, world_rank);
+        }
+    }
+}
+
+// Smallest period-reduced s with a * s == b (mod n), as s == r (mod period); false if none
+bool solve_congruence(int64_t a, int64_t b, int64_t n, int64_t &r, int64_t &period)
+{
+    a = ((a % n) + n) % n;
+    b = ((b % n) + n) % n;
+    if (a == 0)
+    {
+        r = 0;
+        period = 1;
+        return b == 0;
+    }
+
+    // extended Euclid gives g = gcd(a, n) and the inverse of a / g modulo n / g
+    int64_t old_r = a, cur_r = n, old_s = 1, cur_s = 0;
+    while (cur_r != 0)
+    {
+        int64_t q = old_r / cur_r;
+        std::swap(old_r, cur_r);
+        cur_r -= q * old_r;
+        std::swap(old_s, cur_s);
+        cur_s -= q * old_s;
+    }
+    int64_t g = old_r;
+    if (b % g != 0)
+    {
+        return false;
+    }
+    period = n / g;
+    r = (int64_t)((__int128)(b / g) * (((old_s % period) + period) % period) % period);
+    return true;
+}
+
+// First step s >= 1 at which two balls, offset by (bx, by) and with relative velocity
+// (ax, ay), share a cell on the N x M torus, or -1 if they never do
+int64_t first_meeting(int64_t ax, int64_t bx, int64_t N, int64_t ay, int64_t by, int64_t M)
+{
+    int64_t r1, m1, r2, m2;
+    if (!solve_congruence(ax, bx, N, r1, m1) || !solve_congruence(ay, by, M, r2, m2))
+    {
+        return -1;
+    }
+
+    // combine s == r1 (mod m1) and s == r2 (mod m2) with the generalised Chinese remainder theorem
+    int64_t r, period;
+    if (!solve_congruence(m1, r2 - r1, m2, r, period))
+    {
+        return -1;
+    }
+    int64_t lcm = m1 * period;
+    int64_t s = (int64_t)(((__int128)r1 + (__int128)m1 * r) % lcm);
+    return s == 0 ? lcm : s;
+}
+
+// A predicted meeting of ball with partner; entry and partner_version tell whether it still holds
+struct Event
+{
+    int64_t time;
+    int ball, partner;
+    int64_t entry, partner_version;
+
+    bool operator>(const Event &other) const
+    {
+        return time > other.time;
+    }
+};
+
+// Event-driven simulation for collision-sparse runs. Every rank keeps the state of all balls
+// as of their last turn, so positions at any later tick follow analytically, and predicts the
+// next meeting of the balls with id % world_size == world_rank against every other ball by
+// solving the two wrap-around congruences. Each rank's heap is its share of the distributed
+// event queue: an Allreduce(MIN) finds the next tick with a meeting, the balls meeting there
+// are shared with an Allgatherv and turned, and only predictions involving them are redone.
+// Runtime scales with the number of collisions instead of K * T.
+void simulate_events(std::vector<Ball> &my_balls, const RowSplit &rows, int N, int M, int K, int T, int world_size, int world_rank,
+                     MPI_Datatype MPI_BALL)
+{
+    const int64_t never = std::numeric_limits<int64_t>::max();
+
+    // replicate every ball, indexed by id
+    std::vector<int> counts(world_size), displs(world_size);
+    int count = my_balls.size();
+    MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    for (int i = 1; i < world_size; i++)
+    {
+        displs[i] = displs[i - 1] + counts[i - 1];
+    }
+    std::vector<Ball> gathered(K);
+    MPI_Allgatherv(my_balls.data(), count, MPI_BALL, gathered.data(), counts.data(), displs.data(), MPI_BALL, MPI_COMM_WORLD);
+
+    // ball state as of tick since[i], when it last turned
+    std::vector<int64_t> bx(K), by(K), since(K, 0), version(K, 0);
+    std::vector<int> bd(K);
+    for (const auto &ball : gathered)
+    {
+        bx[ball.id] = ball.x;
+        by[ball.id] = ball.y;
+        bd[ball.id] = ball.d;
+    }
+    auto x_at = [&](int i, int64_t t)
+    { return (int)(((bx[i] + dx[bd[i]] * (t - since[i])) % N + N) % N); };
+    auto y_at = [&](int i, int64_t t)
+    { return (int)(((by[i] + dy[bd[i]] * (t - since[i])) % M + M) % M); };
+
+    // first tick after now at which balls i and j share a cell
+    auto meeting = [&](int i, int j, int64_t now)
+    {
+        int64_t s = first_meeting(dx[bd[i]] - dx[bd[j]], x_at(j, now) - x_at(i, now), N,
+                                  dy[bd[i]] - dy[bd[j]], y_at(j, now) - y_at(i, now), M);
+        return s < 0 ? never : now + s;
+    };
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    std::vector<int64_t> entry(K, 0), predicted(K, never);
+
+    // predict the next meeting of one of my balls against all others
+    auto predict = [&](int i, int64_t now)
+    {
+        Event best = {never, i, i, ++entry[i], 0};
+        for (int j = 0; j < K; j++)
+        {
+            int64_t t = j == i ? never : meeting(i, j, now);
+            if (t < best.time)
+            {
+                best.time = t;
+                best.partner = j;
+            }
+        }
+        best.partner_version = version[best.partner];
+        predicted[i] = best.time;
+        if (best.time <= T)
+        {
+            events.push(best);
+        }
+    };
+
+    for (int i = world_rank; i < K; i += world_size)
+    {
+        predict(i, 0);
+    }
+
+    int64_t now = 0;
+    std::vector<int> hits, all_hits;
+    std::vector<char> hit(K, 0);
+    std::vector<std::pair<int64_t, int>> cells;
+    while (true)
+    {
+        // drop superseded predictions and redo the ones whose partner has turned since
+        while (!events.empty())
+        {
+            Event ev = events.top();
+            if (ev.entry != entry[ev.ball])
+            {
+                events.pop();
+            }
+            else if (ev.partner_version != version[ev.partner])
+            {
+                events.pop();
+                predict(ev.ball, now);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        int64_t next = events.empty() ? never : events.top().time;
+        MPI_Allreduce(MPI_IN_PLACE, &next, 1, MPI_INT64_T, MPI_MIN, MPI_COMM_WORLD);
+        if (next > T)
+        {
+            break;
+        }
+
+        // collect my balls that meet another one at the next tick
+        hits.clear();
+        while (!events.empty() && events.top().time == next)
+        {
+            Event ev = events.top();
+            events.pop();
+            if (ev.entry != entry[ev.ball])
+            {
+                continue;
+            }
+            if (ev.partner_version != version[ev.partner])
+            {
+                predict(ev.ball, now);
+                continue;
+            }
+            hits.push_back(ev.ball);
+        }
+
+        count = hits.size();
+        MPI_Allgather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+        for (int i = 1; i < world_size; i++)
+        {
+            displs[i] = displs[i - 1] + counts[i - 1];
+        }
+        all_hits.resize(displs[world_size - 1] + counts[world_size - 1]);
+        MPI_Allgatherv(hits.data(), count, MPI_INT, all_hits.data(), counts.data(), displs.data(), MPI_INT, MPI_COMM_WORLD);
+
+        // every ball in a shared cell at the next tick is among the hits, so counting them is enough
+        now = next;
+        cells.clear();
+        for (int i : all_hits)
+        {
+            cells.push_back({(int64_t)x_at(i, now) * M + y_at(i, now), i});
+        }
+        std::sort(cells.begin(), cells.end());
+
+        std::vector<int> turned;
+        for (size_t a = 0, b; a < cells.size(); a = b)
+        {
+            for (b = a; b < cells.size() && cells[b].first == cells[a].first; b++)
+            {
+            }
+            int turn = dd[b - a - 1];
+            for (size_t c = a; c < b; c++)
+            {
+                int i = cells[c].second;
+                bx[i] = x_at(i, now);
+                by[i] = y_at(i, now);
+                since[i] = now;
+                hit[i] = 1;
+                if (turn != 0)
+                {
+                    bd[i] = (bd[i] + turn) % 4;
+                    version[i]++;
+                    turned.push_back(i);
+                }
+            }
+        }
+
+        // my balls that met get a fresh prediction, the others only need checking against the turned ones
+        for (int i : hits)
+        {
+            predict(i, now);
+        }
+        for (int k : turned)
+        {
+            for (int i = world_rank; i < K; i += world_size)
+            {
+                if (hit[i] || i == k)
+                {
+                    continue;
+                }
+                int64_t t = meeting(i, k, now);
+                if (t < predicted[i] && t <= T)
+                {
+                    predicted[i] = t;
+                    events.push({t, i, k, ++entry[i], version[k]});
+                }
+            }
+        }
+        for (int i : all_hits)
+        {
+            hit[i] = 0;
+        }
+    }
+
+    // advance everyone to T and keep the balls this rank owns by row
+    my_balls.clear();
+    for (int i = 0; i < K; i++)
+    {
+        int x = x_at(i, T);
+        if (rows.owner(x) == world_rank)
+        {
+            my_balls.push_back({i, x, y_at(i, T), bd[i]});
+        }
+    }
+}
+
+// Runs one text scenario on the ranks of group as row slabs and returns the final state,
+// sorted by id, on the group's rank 0; K is -1 there if the file could not be read
+std::vector<Ball> run_scenario(MPI_Comm group, const std::string &path, int &K, MPI_Datatype MPI_BALL)
+{
+    int group_size, group_rank;
+    MPI_Comm_size(group, &group_size);
+    MPI_Comm_rank(group, &group_rank);
+
+    int sizes[4] = {1, 1, -1, 0};
+    std::vector<Ball> balls;
+    if (group_rank == 0)
+    {
+        std::ifstream in(path);
+        if (!in || !read_text(in, sizes[0], sizes[1], sizes[2], sizes[3], balls))
+        {
+            sizes[0] = sizes[1] = 1;
+            sizes[2] = -1;
+            sizes[3] = 0;
+            balls.clear();
+        }
+    }
+    MPI_Bcast(sizes, 4, MPI_INT, 0, group);
+    int N = sizes[0], M = sizes[1], T = sizes[3];
+    K = sizes[2];
+    if (K < 0)
+    {
+        return balls;
+    }
+
+    // more ranks than rows would leave slabs empty, so large groups use only the first N ranks
+    int used = std::min(group_size, N);
+    MPI_Comm slab_comm;
+    MPI_Comm_split(group, group_rank < used ? 0 : MPI_UNDEFINED, group_rank, &slab_comm);
+    std::vector<Ball> result;
+    if (slab_comm != MPI_COMM_NULL)
+    {
+        Blocks blocks(slab_comm, N, M, used, 1);
+
+        std::vector<int> counts(used), displs(used);
+        std::vector<Ball> ordered;
+        if (group_rank == 0)
+        {
+            std::vector<std::vector<Ball>> buckets(used);
+            for (const auto &ball : balls)
+            {
+                buckets[blocks.owner(ball.x, ball.y)].push_back(ball);
+            }
+            for (int r = 0; r < used; r++)
+            {
+                counts[r] = buckets[r].size();
+                displs[r] = ordered.size();
+                ordered.insert(ordered.end(), buckets[r].begin(), buckets[r].end());
+            }
+        }
+        int my_count;
+        MPI_Scatter(counts.data(), 1, MPI_INT, &my_count, 1, MPI_INT, 0, slab_comm);
+        std::vector<Ball> my_balls(my_count);
+        MPI_Scatterv(ordered.data(), counts.data(), displs.data(), MPI_BALL, my_balls.data(), my_count, MPI_BALL, 0, slab_comm);
+
+        BallSet local_balls(my_balls);
+        CellCounter cells(M);
+        simulate(local_balls, cells, blocks, N, M, T, group_rank, MPI_BALL, false, 0, nullptr, nullptr);
+        my_balls = local_balls.to_balls();
+
+        my_count = my_balls.size();
+        MPI_Gather(&my_count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, slab_comm);
+        if (group_rank == 0)
+        {
+            for (int r = 1; r < used; r++)
+            {
+                displs[r] = displs[r - 1] + counts[r - 1];
+            }
+            result.resize(K);
+        }
+        MPI_Gatherv(my_balls.data(), my_count, MPI_BALL, result.data(), counts.data(), displs.data(), MPI_BALL, 0, slab_comm);
+        std::sort(result.begin(), result.end(), [](const Ball &a, const Ball &b)
+                  { return a.id < b.id; });
+
+        MPI_Comm_free(&blocks.comm);
+        MPI_Comm_free(&slab_comm);
+    }
+    return result;
+}
+
+// Ensemble mode: runs every scenario listed in list_path (one text input file per line) in one
+// job. Rank 0 schedules and the other ranks are split into groups, one per scenario as far as
+// they go, each sized to the ceil(K / balls_per_rank) ranks its scenario wants. Scenarios are
+// handed out largest first: a group that frees up takes the largest waiting scenario that fits
+// it, or the largest waiting one if none does. Each group's rank 0 sends its result back tagged
+// with the scenario number, and rank 0 prints "scenario i path" and the final state as results
+// arrive.
+void run_ensemble(const char *list_path, int balls_per_rank, int world_size, int world_rank, MPI_Datatype MPI_BALL)
+{
+    std::vector<std::string> paths;
+    std::ifstream list(list_path);
+    for (std::string line; std::getline(list, line);)
+    {
+        if (!line.empty())
+        {
+            paths.push_back(line);
+        }
+    }
+    int scenarios = paths.size(), workers = world_size - 1;
+
+    // rank 0 reads the headers and decides the group sizes for everyone
+    std::vector<int> wanted(scenarios, 1), group_sizes;
+    if (world_rank == 0)
+    {
+        for (int i = 0; i < scenarios; i++)
+        {
+            std::ifstream in(paths[i]);
+            int64_t N, M, K;
+            if (in >> N >> M >> K)
+            {
+                wanted[i] = (int)std::max<int64_t>(1, std::min<int64_t>(workers, (K + balls_per_rank - 1) / balls_per_rank));
+            }
+        }
+        std::vector<int> by_size = wanted;
+        std::sort(by_size.rbegin(), by_size.rend());
+        int left = workers;
+        for (int size : by_size)
+        {
+            if (left == 0)
+            {
+                break;
+            }
+            group_sizes.push_back(std::min(size, left));
+            left -= group_sizes.back();
+        }
+        // spare ranks join the largest group
+        if (left > 0 && !group_sizes.empty())
+        {
+            group_sizes[0] += left;
+        }
+    }
+    int groups = group_sizes.size();
+    MPI_Bcast(&groups, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    group_sizes.resize(groups);
+    MPI_Bcast(group_sizes.data(), groups, MPI_INT, 0, MPI_COMM_WORLD);
+
+    std::vector<int> leaders(groups);
+    int color = MPI_UNDEFINED;
+    for (int g = 0, first = 1; g < groups; first += group_sizes[g], g++)
+    {
+        leaders[g] = first;
+        if (world_rank >= first && world_rank < first + group_sizes[g])
+        {
+            color = g;
+        }
+    }
+    MPI_Comm group;
+    MPI_Comm_split(MPI_COMM_WORLD, color, world_rank, &group);
+
+    if (world_rank == 0)
+    {
+        std::vector<int> pending(scenarios);
+        for (int i = 0; i < scenarios; i++)
+        {
+            pending[i] = i;
+        }
+        std::stable_sort(pending.begin(), pending.end(), [&](int a, int b)
+                         { return wanted[a] > wanted[b]; });
+
+        // the largest waiting scenario that fits a group of this size, or the largest one
+        auto take = [&](int size)
+        {
+            auto it = std::find_if(pending.begin(), pending.end(), [&](int i)
+                                   { return wanted[i] <= size; });
+            if (it == pending.end())
+            {
+                it = pending.begin();
+            }
+            int scenario = *it;
+            pending.erase(it);
+            return scenario;
+        };
+
+        int running = 0;
+        for (int g = 0; g < groups; g++)
+        {
+            int scenario = pending.empty() ? -1 : take(group_sizes[g]);
+            MPI_Send(&scenario, 1, MPI_INT, leaders[g], 0, MPI_COMM_WORLD);
+            running += scenario >= 0;
+        }
+
+        std::vector<Ball> result;
+        while (running > 0)
+        {
+            int header[2];
+            MPI_Status status;
+            MPI_Recv(header, 2, MPI_INT, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
+            result.resize(std::max(header[1], 0));
+            MPI_Recv(result.data(), result.size(), MPI_BALL, status.MPI_SOURCE, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            running--;
+
+            std::cout << "scenario " << header[0] << " " << paths[header[0]] << "\n";
+            if (header[1] < 0)
+            {
+                std::cout << "cannot read " << paths[header[0]] << "\n";
+            }
+            print_balls(std::cout, result);
+            std::cout.flush();
+
+            int g = std::find(leaders.begin(), leaders.end(), status.MPI_SOURCE) - leaders.begin();
+            int scenario = pending.empty() ? -1 : take(group_sizes[g]);
+            MPI_Send(&scenario, 1, MPI_INT, leaders[g], 0, MPI_COMM_WORLD);
+            running += scenario >= 0;
+        }
+        return;
+    }
+
+    if (group == MPI_COMM_NULL)
+    {
+        return;
+    }
+    int group_rank;
+    MPI_Comm_rank(group, &group_rank);
+    while (true)
+    {
+        int scenario;
+        if (group_rank == 0)
+        {
+            MPI_Recv(&scenario, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        MPI_Bcast(&scenario, 1, MPI_INT, 0, group);
+        if (scenario < 0)
+        {
+            break;
+        }
+
+        int K;
+        std::vector<Ball> result = run_scenario(group, paths[scenario], K, MPI_BALL);
+        if (group_rank == 0)
+        {
+            int header[2] = {scenario, K};
+            MPI_Send(header, 2, MPI_INT, 0, 1, MPI_COMM_WORLD);
+            MPI_Send(result.data(), result.size(), MPI_BALL, 0, 2, MPI_COMM_WORLD);
+        }
+    }
+    MPI_Comm_free(&group);
+}
+
 int main(int argc, char **argv)
 {
     // Initialize the MPI environment
@@ -20,6 +2080,131 @@ int main(int argc, char **argv)
     MPI_Comm_size(MPI_COMM_WORLD, &world_size);
     MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
 
+    // --dense counts collisions in a dense grid of the owned block instead of a hash,
+    // --sorted keeps the balls sorted by cell and counts runs of equal cells instead,
+    // --events skips between collisions analytically instead of stepping every tick,
+    // --cycle detects a repeating global state and skips the remaining whole cycles,
+    // --halo k exchanges k ghost rows once every k steps instead of balls every step,
+    // --rebalance R moves the row boundaries to even out the ball counts every R steps,
+    // --grid Px Py splits the cells over a Px x Py process grid instead of row slabs,
+    // --input file reads the binary format collectively instead of text from stdin,
+    // --snapshot S file writes every ball to file every S steps,
+    // --generate uniform|bands|dense N M K T makes the balls on every rank instead of reading
+    // them and prints a timing line instead of the state; --seed s varies the configuration
+    // and --verify checks the result against the serial reference (small cases only),
+    // --profile R prints the time per step phase (move and pack, exchange, count, collide,
+    // other), min/mean/max over the ranks, every R steps,
+    // plus the operator new calls per step in a build with alloc_count.cpp (see there),
+    // --bench-kernel K R times the step kernels alone and exits,
+    // --ensemble list runs every text input named in list, one per line, on groups of ranks,
+    // sized for --balls-per-rank B balls per rank (default 100000), and prints each result
+    bool dense = false, sorted = false, events = false, cycle = false;
+    int halo = 0, rebalance_every = 0, px = world_size, py = 1;
+    const char *input = nullptr, *snapshot_path = nullptr;
+    int snapshot_every = 0;
+    int generate = -1, generate_size[4];
+    uint64_t seed = 1;
+    bool verify = false;
+    int profile_every = 0;
+    const char *ensemble = nullptr;
+    int balls_per_rank = 100000;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--dense") == 0)
+        {
+            dense = true;
+        }
+        else if (strcmp(argv[i], "--sorted") == 0)
+        {
+            sorted = true;
+        }
+        else if (strcmp(argv[i], "--events") == 0)
+        {
+            events = true;
+        }
+        else if (strcmp(argv[i], "--cycle") == 0)
+        {
+            cycle = true;
+        }
+        else if (strcmp(argv[i], "--halo") == 0 && i + 1 < argc)
+        {
+            halo = std::stoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rebalance") == 0 && i + 1 < argc)
+        {
+            rebalance_every = std::stoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--grid") == 0 && i + 2 < argc)
+        {
+            px = std::stoi(argv[i + 1]);
+            py = std::stoi(argv[i + 2]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+        {
+            input = argv[++i];
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 2 < argc)
+        {
+            snapshot_every = std::stoi(argv[i + 1]);
+            snapshot_path = argv[i + 2];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--generate") == 0 && i + 5 < argc)
+        {
+            const char *kinds[3] = {"uniform", "bands", "dense"};
+            for (int kind = 0; kind < 3; kind++)
+            {
+                if (strcmp(argv[i + 1], kinds[kind]) == 0)
+                {
+                    generate = kind;
+                }
+            }
+            if (generate < 0)
+            {
+                if (world_rank == 0)
+                {
+                    std::cerr << "unknown workload " << argv[i + 1] << std::endl;
+                }
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            for (int k = 0; k < 4; k++)
+            {
+                generate_size[k] = std::stoi(argv[i + 2 + k]);
+            }
+            i += 5;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = std::stoull(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profile_every = std::stoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--verify") == 0)
+        {
+            verify = true;
+        }
+        else if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc)
+        {
+            ensemble = argv[++i];
+        }
+        else if (strcmp(argv[i], "--balls-per-rank") == 0 && i + 1 < argc)
+        {
+            balls_per_rank = std::stoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bench-kernel") == 0 && i + 2 < argc)
+        {
+            if (world_rank == 0)
+            {
+                bench_kernels(std::stoi(argv[i + 1]), std::stoi(argv[i + 2]));
+            }
+            MPI_Finalize();
+            return 0;
+        }
+    }
+
     // Define a new MPI datatype for the Ball struct
     int blocklengths[4] = {1, 1, 1, 1};
     MPI_Datatype types[4] = {MPI_INT, MPI_INT, MPI_INT, MPI_INT};
@@ -33,30 +2218,50 @@ int main(int argc, char **argv)
     MPI_Type_create_struct(4, blocklengths, offsets, types, &MPI_BALL);
     MPI_Type_commit(&MPI_BALL);
 
+    // rank 0 only schedules, so an ensemble needs at least one more rank to run on
+    if (ensemble)
+    {
+        if (world_size < 2 || balls_per_rank < 1)
+        {
+            if (world_rank == 0)
+            {
+                std::cerr << "--ensemble needs at least 2 processes and B >= 1" << std::endl;
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        run_ensemble(ensemble, balls_per_rank, world_size, world_rank, MPI_BALL);
+        MPI_Type_free(&MPI_BALL);
+        MPI_Finalize();
+        return 0;
+    }
+
     int N, M, K, T;
     std::vector<Ball> balls;
 
-    if (world_rank == 0)
+    MPI_File file;
+    if (generate >= 0)
     {
-        // Root process reads the input
-        std::cin >> N >> M >> K >> T;
-
-        for (int i = 0; i < K; i++)
-        {
-            int x, y, d;
-            char c;
-            std::cin >> x >> y >> c;
-            if (c == 'U')
-                d = 0;
-            else if (c == 'R')
-                d = 1;
-            else if (c == 'D')
-                d = 2;
-            else
-                d = 3;
-
-            balls.push_back({i, x, y, d});
+        N = generate_size[0];
+        M = generate_size[1];
+        K = generate_size[2];
+        T = generate_size[3];
+    }
+    else if (input)
+    {
+        if (MPI_File_open(MPI_COMM_WORLD, input, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+        {
+            if (world_rank == 0)
+            {
+                std::cerr << "cannot open " << input << std::endl;
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        read_header(file, N, M, K, T);
+    }
+    else if (world_rank == 0)
+    {
+        // Root process reads the input
+        read_text(std::cin, N, M, K, T, balls);
     }
 
     // Share the values of N, M, K, and T
@@ -65,209 +2270,256 @@ int main(int argc, char **argv)
     MPI_Bcast(&K, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&T, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-    // Distribute the balls to the appropriate processes
-    std::vector<std::vector<Ball>> ball_distribution(world_size);
-    if (world_rank == 0)
+    // the ghost zones have to come from the direct neighbours and must not overlap
+    if (halo != 0 && world_size > 1)
     {
-        for (const auto &ball : balls)
+        int min_rows = N / world_size;
+        if (halo < 1 || halo > min_rows || (world_size == 2 && 2 * halo > min_rows))
         {
-            int owner = ball.x * world_size / N;
-            ball_distribution[owner].push_back(ball);
+            if (world_rank == 0)
+            {
+                std::cerr << "--halo " << halo << " does not fit slabs of " << min_rows << " rows" << std::endl;
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
     }
 
-    int ball_count = 0;
-    if (world_rank == 0)
+    // the other modes work on row slabs only
+    if (px < 1 || py < 1 || px * py != world_size || (py > 1 && (py > M || events || halo > 0 || rebalance_every > 0)))
     {
-        ball_count = ball_distribution[0].size();
-        for (int i = 1; i < world_size; i++)
+        if (world_rank == 0)
         {
-            int count = ball_distribution[i].size();
-            MPI_Send(&count, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
+            std::cerr << "--grid " << px << " " << py << " needs Px * Py == " << world_size
+                      << " and, with Py > 1, Py <= M and the per-step mode without --rebalance" << std::endl;
         }
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    else
+
+    // every generated ball needs a cell of its own
+    if (generate >= 0 && (int64_t)K > Workload(generate, seed, N, M, K).cells)
     {
-        MPI_Recv(&ball_count, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (world_rank == 0)
+        {
+            std::cerr << "--generate: " << K << " balls do not fit in distinct cells" << std::endl;
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
-    std::vector<Ball> my_balls(ball_count);
-    if (world_rank == 0)
+    // both replace the cell hash of the per-step loop
+    if (sorted && (dense || events || halo > 0))
     {
-        my_balls = ball_distribution[0];
-        for (int i = 1; i < world_size; i++)
+        if (world_rank == 0)
         {
-            MPI_Send(ball_distribution[i].data(), ball_distribution[i].size(), MPI_BALL, i, 0, MPI_COMM_WORLD);
+            std::cerr << "--sorted needs the per-step mode without --dense" << std::endl;
         }
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    else
+
+    // the phases timed are those of the per-step loop
+    if (profile_every != 0 && (profile_every < 1 || events || halo > 0))
     {
-        MPI_Recv(my_balls.data(), ball_count, MPI_BALL, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (world_rank == 0)
+        {
+            std::cerr << "--profile needs R >= 1 and the per-step mode" << std::endl;
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
-    int dx[4] = {-1, 0, 1, 0};
-    int dy[4] = {0, 1, 0, -1};
-    int dd[4] = {0, 1, 0, 2};
-
-    // handle collisions
-    std::vector<std::vector<int>> map(N, std::vector<int>(M, 0));
-
-    for (int t = 0; t < T; t++)
+    // frames come from the per-step loop, and skipped cycles would leave holes in them
+    if (snapshot_path && (snapshot_every < 1 || events || halo > 0 || cycle))
     {
-        std::vector<Ball> send_top_balls, send_bottom_balls, receive_top_balls, receive_bottom_balls;
+        if (world_rank == 0)
+        {
+            std::cerr << "--snapshot needs S >= 1 and the per-step mode without --cycle" << std::endl;
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
-        // Update positions and determine ownership
-        int i = 0;
-        while (i < my_balls.size())
+    // moving boundaries need the per-step exchange and a row for every rank
+    if (rebalance_every > 0 && (events || halo > 0 || N < world_size))
+    {
+        if (world_rank == 0)
         {
-            my_balls[i].x = (my_balls[i].x + dx[my_balls[i].d] + N) % N;
-            my_balls[i].y = (my_balls[i].y + dy[my_balls[i].d] + M) % M;
+            std::cerr << "--rebalance needs the per-step mode and at least one row per process" << std::endl;
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
-            int owner = my_balls[i].x * world_size / N;
-            if (owner != world_rank)
+    // Distribute the balls to the appropriate processes
+    Blocks blocks(MPI_COMM_WORLD, N, M, px, py);
+    std::vector<Ball> my_balls;
+    if (generate >= 0)
+    {
+        my_balls = generate_balls(Workload(generate, seed, N, M, K), blocks, K, world_size, world_rank, MPI_BALL);
+    }
+    else if (input)
+    {
+        my_balls = read_balls(file, blocks, K, world_size, world_rank, MPI_BALL);
+        MPI_File_close(&file);
+    }
+    else
+    {
+        std::vector<std::vector<Ball>> ball_distribution(world_size);
+        if (world_rank == 0)
+        {
+            for (const auto &ball : balls)
             {
-                if ((world_rank - owner + world_size) % world_size == 1)
-                {
-                    send_top_balls.push_back(my_balls[i]);
-                }
-                else
-                {
-                    send_bottom_balls.push_back(my_balls[i]);
-                }
-                my_balls.erase(my_balls.begin() + i);
+                int owner = blocks.owner(ball.x, ball.y);
+                ball_distribution[owner].push_back(ball);
             }
-            else
+        }
+
+        int ball_count = 0;
+        if (world_rank == 0)
+        {
+            ball_count = ball_distribution[0].size();
+            for (int i = 1; i < world_size; i++)
             {
-                i++;
+                int count = ball_distribution[i].size();
+                MPI_Send(&count, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
             }
         }
-
-        // Allocate space for receiving balls
-        int top_count = 0, bottom_count = 0;
-
-        MPI_Request send_requests[2], recv_requests[2];
-        MPI_Status statuses[2];
-
-        // Exchange counts first
-        int send_top_balls_size = send_top_balls.size();
-        int send_bottom_balls_size = send_bottom_balls.size();
-        MPI_Send(&send_top_balls_size, 1, MPI_INT, (world_rank - 1 + world_size) % world_size, 0, MPI_COMM_WORLD);
-        MPI_Send(&send_bottom_balls_size, 1, MPI_INT, (world_rank + 1) % world_size, 0, MPI_COMM_WORLD);
-
-        MPI_Irecv(&top_count, 1, MPI_INT, (world_rank - 1 + world_size) % world_size, 0, MPI_COMM_WORLD, &recv_requests[0]);
-        MPI_Irecv(&bottom_count, 1, MPI_INT, (world_rank + 1) % world_size, 0, MPI_COMM_WORLD, &recv_requests[1]);
-
-        MPI_Waitall(2, recv_requests, statuses);
-
-        // Resize receive buffers
-        receive_top_balls.resize(top_count);
-        receive_bottom_balls.resize(bottom_count);
-
-        // Send and receive balls
-        MPI_Isend(send_top_balls.data(), send_top_balls.size(), MPI_BALL, (world_rank - 1 + world_size) % world_size, 1, MPI_COMM_WORLD, &send_requests[0]);
-        MPI_Isend(send_bottom_balls.data(), send_bottom_balls.size(), MPI_BALL, (world_rank + 1) % world_size, 1, MPI_COMM_WORLD, &send_requests[1]);
-
-        MPI_Irecv(receive_top_balls.data(), top_count, MPI_BALL, (world_rank - 1 + world_size) % world_size, 1, MPI_COMM_WORLD, &recv_requests[0]);
-        MPI_Irecv(receive_bottom_balls.data(), bottom_count, MPI_BALL, (world_rank + 1) % world_size, 1, MPI_COMM_WORLD, &recv_requests[1]);
-
-        // Handle collisions
-        map = std::vector<std::vector<int>>(N, std::vector<int>(M, 0));
-        for (const auto &ball : my_balls)
+        else
         {
-            map[ball.x][ball.y]++;
+            MPI_Recv(&ball_count, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
         }
 
-        MPI_Waitall(2, recv_requests, statuses);
+        my_balls.resize(ball_count);
+        if (world_rank == 0)
+        {
+            my_balls = ball_distribution[0];
+            for (int i = 1; i < world_size; i++)
+            {
+                MPI_Send(ball_distribution[i].data(), ball_distribution[i].size(), MPI_BALL, i, 0, MPI_COMM_WORLD);
+            }
+        }
+        else
+        {
+            MPI_Recv(my_balls.data(), ball_count, MPI_BALL, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+    }
 
-        // Update local state
-        my_balls.insert(my_balls.end(), receive_top_balls.begin(), receive_top_balls.end());
-        my_balls.insert(my_balls.end(), receive_bottom_balls.begin(), receive_bottom_balls.end());
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
 
-        for (const auto &ball : receive_top_balls)
+    if (events)
+    {
+        simulate_events(my_balls, blocks.rows, N, M, K, T, world_size, world_rank, MPI_BALL);
+    }
+    else if (halo > 0)
+    {
+        // the ghost rows fall outside a slab-local dense grid, so the halo mode always counts in the hash
+        BallSet local_balls(my_balls);
+        simulate_halo(local_balls, blocks.rows, N, M, T, halo, world_size, world_rank, MPI_BALL, cycle);
+        my_balls = local_balls.to_balls();
+    }
+    else
+    {
+        // handle collisions in a dense grid of the owned block, by sorting the balls by cell, or in
+        // a sparse cell hash
+        BallSet local_balls(my_balls);
+        std::unique_ptr<SnapshotWriter> snapshots;
+        if (snapshot_path)
         {
-            map[ball.x][ball.y]++;
+            snapshots.reset(new SnapshotWriter(snapshot_path, N, M, K, snapshot_every, world_rank, MPI_BALL));
         }
-        for (const auto &ball : receive_bottom_balls)
+        std::unique_ptr<StepProfile> profile;
+        if (profile_every > 0)
         {
-            map[ball.x][ball.y]++;
+            profile.reset(new StepProfile(profile_every));
         }
-
-        // Process collisions
-        for (auto &ball : my_balls)
+        if (dense)
+        {
+            DenseGrid cells(blocks.rows.begin[blocks.cx], blocks.rows.begin[blocks.cx + 1],
+                            blocks.cols.begin[blocks.cy], blocks.cols.begin[blocks.cy + 1]);
+            simulate(local_balls, cells, blocks, N, M, T, world_rank, MPI_BALL, cycle, rebalance_every, snapshots.get(),
+                     profile.get());
+        }
+        else if (sorted)
+        {
+            CellSorter cells(blocks.rows.begin[blocks.cx], blocks.rows.begin[blocks.cx + 1]);
+            simulate(local_balls, cells, blocks, N, M, T, world_rank, MPI_BALL, cycle, rebalance_every, snapshots.get(),
+                     profile.get());
+        }
+        else
+        {
+            CellCounter cells(M);
+            simulate(local_balls, cells, blocks, N, M, T, world_rank, MPI_BALL, cycle, rebalance_every, snapshots.get(),
+                     profile.get());
+        }
+        if (snapshots)
         {
-            ball.d = (ball.d + dd[map[ball.x][ball.y] - 1]) % 4;
+            snapshots->close();
         }
+        my_balls = local_balls.to_balls();
     }
 
-    // get all the balls to the root process
-    std::vector<std::vector<Ball>> all_balls(world_size);
-    for (int i = 0; i < world_size; i++)
+    MPI_Barrier(MPI_COMM_WORLD);
+    double elapsed = MPI_Wtime() - start;
+
+    // Gather all the balls to the root process in one collective
+    int my_count = my_balls.size();
+    std::vector<int> counts(world_size), displs(world_size);
+    MPI_Gather(&my_count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    std::vector<Ball> all_balls;
+    if (world_rank == 0)
     {
-        if (world_rank == i)
+        for (int i = 1; i < world_size; i++)
         {
-            all_balls[i] = my_balls;
+            displs[i] = displs[i - 1] + counts[i - 1];
         }
+        all_balls.resize(displs[world_size - 1] + counts[world_size - 1]);
     }
+    MPI_Gatherv(my_balls.data(), my_count, MPI_BALL, all_balls.data(), counts.data(), displs.data(), MPI_BALL, 0, MPI_COMM_WORLD);
 
-    // Gather all the balls to the root process
-    for (int i = 0; i < world_size; i++)
+    // generated runs report their speed and, if asked, whether they match the serial reference
+    if (generate >= 0 && world_rank == 0)
     {
-        MPI_Barrier(MPI_COMM_WORLD);
-        if (world_rank == i)
+        std::cout << "P " << world_size << " N " << N << " M " << M << " K " << K << " T " << T << " seconds " << elapsed
+                  << " steps/s " << T / elapsed << " ball-steps/s " << (double)K * T / elapsed << std::endl;
+        if (verify)
         {
-            for (int j = 0; j < world_size; j++)
+            Workload workload(generate, seed, N, M, K);
+            std::vector<Ball> expected(K);
+            for (int i = 0; i < K; i++)
             {
-                if (j == i)
-                {
-                    continue;
-                }
+                expected[i] = workload.ball(i);
+            }
+            reference_simulate(expected, N, M, T);
 
-                int count = 0;
-                MPI_Recv(&count, 1, MPI_INT, j, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                all_balls[j].resize(count);
-                MPI_Recv(all_balls[j].data(), count, MPI_BALL, j, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            std::sort(all_balls.begin(), all_balls.end(), [](const Ball &a, const Ball &b)
+                      { return a.id < b.id; });
+            int mismatches = all_balls.size() == expected.size() ? 0 : K;
+            for (size_t i = 0; mismatches == 0 && i < expected.size(); i++)
+            {
+                const Ball &a = all_balls[i], &b = expected[i];
+                mismatches += a.id != b.id || a.x != b.x || a.y != b.y || a.d != b.d;
             }
-        }
-        else
-        {
-            int count = my_balls.size();
-            MPI_Send(&count, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
-            MPI_Send(my_balls.data(), count, MPI_BALL, i, 0, MPI_COMM_WORLD);
+            std::cout << "verify: " << (mismatches == 0 ? "ok" : "MISMATCH") << std::endl;
         }
     }
 
     // Print the balls from the root process
-    if (world_rank == 0)
+    else if (world_rank == 0)
     {
-        // sort the balls by id
-        std::vector<Ball> all_balls_sorted;
-        for (int i = 0; i < world_size; i++)
+        // ids are 0..K-1, so swapping every ball into its slot sorts them in place in O(K)
+        for (size_t i = 0; i < all_balls.size(); i++)
         {
-            all_balls_sorted.insert(all_balls_sorted.end(), all_balls[i].begin(), all_balls[i].end());
+            while (all_balls[i].id != (int)i)
+            {
+                std::swap(all_balls[i], all_balls[all_balls[i].id]);
+            }
         }
 
-        std::sort(all_balls_sorted.begin(), all_balls_sorted.end(), [](const Ball &a, const Ball &b)
-                  { return a.id < b.id; });
-
         std::cout << std::endl;
-
-        for (const auto &ball : all_balls_sorted)
-        {
-            std::cout << ball.x << " " << ball.y << " ";
-            if (ball.d == 0)
-                std::cout << "U";
-            else if (ball.d == 1)
-                std::cout << "R";
-            else if (ball.d == 2)
-                std::cout << "D";
-            else
-                std::cout << "L";
-            std::cout << std::endl;
-        }
+        print_balls(std::cout, all_balls);
+        std::cout.flush();
     }
 
-    // Clean up the custom datatype
+    // Clean up the custom datatype and the process grid
     MPI_Type_free(&MPI_BALL);
+    MPI_Comm_free(&blocks.comm);
 
     // Clean up the MPI environment
     MPI_Finalize();
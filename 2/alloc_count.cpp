@@ -0,0 +1,77 @@
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+
+// Counts every call to operator new, in all its forms, for the allocation column of 2.cpp's
+// --profile. Linked only into the profiling build:
+//
+//   mpicxx -O3 -march=native -DCOUNT_ALLOCATIONS -o 2_profile 2.cpp alloc_count.cpp
+//
+// The array forms and the nothrow deletes of the library forward to the ones here.
+// Allocations made with malloc, as inside MPI, are not seen.
+uint64_t heap_allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    heap_allocations++;
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return operator new(size);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    heap_allocations++;
+    std::size_t align = (std::size_t)alignment;
+    if (void *p = std::aligned_alloc(align, (size + align - 1) / align * align))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    try
+    {
+        return operator new(size, alignment);
+    }
+    catch (const std::bad_alloc &)
+    {
+        return nullptr;
+    }
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept
+{
+    std::free(p);
+}
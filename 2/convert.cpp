@@ -0,0 +1,56 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+
+// Converts the text input of 2.cpp (N M K T, then K lines "x y c") read from stdin into the
+// binary format read with --input: four int32 N, M, K, T, then K records of int32 x, y, d
+// with d = 0, 1, 2, 3 for U, R, D, L. Ball i is the i-th record.
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "usage: " << argv[0] << " output.bin < input.txt" << std::endl;
+        return 1;
+    }
+
+    std::ios::sync_with_stdio(false);
+    std::ofstream out(argv[1], std::ios::binary);
+    if (!out)
+    {
+        std::cerr << "cannot open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    int32_t header[4];
+    std::cin >> header[0] >> header[1] >> header[2] >> header[3];
+    out.write((const char *)header, sizeof(header));
+
+    // write in blocks so that memory stays bounded for any K
+    const int block = 1 << 16;
+    std::vector<int32_t> records;
+    records.reserve(3 * block);
+    for (int i = 0; i < header[2]; i++)
+    {
+        int x, y;
+        char c;
+        std::cin >> x >> y >> c;
+        int d = c == 'U' ? 0 : c == 'R' ? 1 : c == 'D' ? 2 : 3;
+        records.push_back(x);
+        records.push_back(y);
+        records.push_back(d);
+
+        if (records.size() == 3 * block || i == header[2] - 1)
+        {
+            out.write((const char *)records.data(), records.size() * sizeof(int32_t));
+            records.clear();
+        }
+    }
+
+    if (!std::cin || !out)
+    {
+        std::cerr << "conversion failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
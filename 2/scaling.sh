@@ -0,0 +1,45 @@
+#!/bin/bash
+# Strong and weak scaling series for 2.cpp on generated workloads.
+#
+#   ./scaling.sh [workload] [N M K T] [process counts...]
+#
+# Strong scaling keeps N x M, K and T fixed while the process count grows; weak scaling grows N
+# and K with the process count so every rank keeps the same share of rows and balls. Every run
+# prints one line from --generate with steps/s and ball-steps/s. A small verified run of each
+# workload goes first, so a broken build does not produce numbers. Set MPIRUN to change the
+# launcher (e.g. MPIRUN="mpirun --oversubscribe").
+
+set -e
+cd "$(dirname "$0")"
+
+workload=${1:-uniform}
+N=${2:-4096}
+M=${3:-4096}
+K=${4:-1000000}
+T=${5:-100}
+shift $(($# < 5 ? $# : 5))
+procs=${@:-1 2 4 8}
+MPIRUN=${MPIRUN:-mpirun}
+
+# build in a temporary directory, away from the sources and the checked-in binary
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+binary=$build/2
+mpicxx -O3 -march=native -o $binary 2.cpp
+
+echo "# verify"
+for p in $procs; do
+    $MPIRUN -np $p $binary --generate $workload 256 256 4000 50 --verify | grep -q "verify: ok" ||
+        { echo "verification failed on $p processes" >&2; exit 1; }
+done
+echo "ok"
+
+echo "# strong scaling: $workload N=$N M=$M K=$K T=$T"
+for p in $procs; do
+    $MPIRUN -np $p $binary --generate $workload $N $M $K $T
+done
+
+echo "# weak scaling: $workload per process N=$N M=$M K=$K T=$T"
+for p in $procs; do
+    $MPIRUN -np $p $binary --generate $workload $((N * p)) $M $((K * p)) $T
+done